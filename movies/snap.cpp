@@ -37,6 +37,8 @@
 using namespace std;
 using namespace cv;
 
+#include "kernels.h"
+
 // constants
 const uint32_t snap_size = 20;
 const uint32_t search_size = snap_size + snap_size / 2;
@@ -64,17 +66,16 @@ uint32_t nframes;
 
 void find_cg(Mat &src, Rect roi, int &xc, int &yc, int thresh)
 {
-    int xtot = 0;
-    int ytot = 0;
-    int npix = 0;
-    for (int y = roi.y; y < roi.y + roi.height; y++) {
-        for (int x = roi.x; x < roi.x + roi.width; x++) {
-            if (src.at<uchar>(y, x) < thresh) {
-                xtot += x;
-                ytot += y;
-                npix++;
-            }
-        }
+    uint64_t xtot = 0;
+    uint64_t ytot = 0;
+    uint32_t npix = 0;
+    Rect r = roi & Rect(0, 0, src.cols, src.rows);
+    for (int y = r.y; y < r.y + r.height; y++) {
+        uint64_t xs;
+        uint32_t c = kern->sum_below(src.ptr(y) + r.x, r.width, thresh, &xs);
+        xtot += (uint64_t)r.x * c + xs;
+        ytot += (uint64_t)y * c;
+        npix += c;
     }
     if (npix > 0) {
         xc = xtot / npix;
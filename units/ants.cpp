@@ -37,6 +37,7 @@ using namespace cv::gpu;
 #include "util.h"
 #include "blobs.h"
 #include "ants.h"
+#include "pool.h"
 
 // globals from units.cpp
 extern int frame_index;
@@ -44,6 +45,7 @@ extern double average_frame_time;
 extern uint64_t frame_ticks;
 extern double tps;
 extern running_average laser_frame_lag;
+uint64_t now_ticks();
 
 // options
 extern bool neural_class;
@@ -54,25 +56,30 @@ extern bool verbose;
 // Sizes of ants in sq pixels
 int min_ant_size;
 int max_ant_size;
-uint16_t ant_pix[PIX_TBL_WIDTH][PIX_TBL_HEIGHT];
+uint16_t *ant_pix;
 const int ant_thresh = 100;
 
 // Finds a score for this blob
 void ants::ant_score(struct rec_list *pn)
 {
+    // Rejected by find_bbb, or the laser
+    if (pn->kind != blob_ant) {
+        pn->score = 0;
+        DPRINTF("%4d %4d %3d not an ant\n", pn->xc, pn->yc, pn->npix);
+        return;
+    }
+
     if (neural_class) {
-        std::vector<float> image_type;
-        image_type = pclass->get_image_type(pframe, Point(pn->xc, pn->yc));
-        pn->score = (int)round(image_type[ant_index] * 15.0);
+        // find_blobs scored all the candidates in one batch
+        pn->score = (int)round(pn->image_type[ant_index] * 15.0);
         DPRINTF("neural ant_score: %d %d %d\n", pn->xc, pn->yc, pn->score);
     } else {
         int scale = xpix / pfg->cols;
-        uint64_t color_tot = 0; 
-        assert(pfg->cols == pframe->cols);
         pn->score = 0;
 
         // Ant sizes vary a lot by distance from camera
-        int ideal_count = get_ant_size(pn->xc, pn->yc) / (scale * scale);
+        int full_count = get_ant_size(pn->xc, pn->yc);
+        int ideal_count = full_count / (scale * scale);
         int range = ideal_count / 2;
         if (range == 0)
             range = 1;
@@ -95,43 +102,29 @@ void ants::ant_score(struct rec_list *pn)
 
         // Blob size
         pn->score += 5;
-        // Blob aspect ratio
-        double ratio = (double)pn->rect.width / (double)pn->rect.height;
-        if (ratio < 1.0)
-            ratio = 1.0 / ratio;
-        if (ratio < ant_len * 1.1 / ant_width)
+        // Blob shape, long axis over short axis at any angle
+        if (pn->elong < ant_len * 1.1 / ant_width)
             pn->score += 4;
-        // Ant color
-        int ystart = pn->rect.y/scale;
-        int yend = ystart + pn->rect.height/scale;
-        int xstart = pn->rect.x/scale;
-        int xend = xstart + pn->rect.width/scale;
-        int cc = 0;
-
-        for (int y = ystart; y < yend; y++) {
-            for (int x = xstart; x < xend; x++) {
-                if (pfg->at<uchar>(y, x) == ant_thresh &&
-                    pframe->at<uchar>(y, x) < ant_color) {
-                        cc++;
-                }
-                if (pfg->at<uchar>(y, x) == ant_thresh) {
-                    DPRINTF("%3d ", pframe->at<uchar>(y, x));
-                } else {
-                    DPRINTF("999 ");
-                }
-            }
-            DPRINTF("\n");
+        // Ant color, find_bbb counted the dark frame pixels under
+        // the blob
+        int cc = pn->dark;
+
+        // A half size blob's centroid is only good to 2 pixels,
+        // the dark pixels pin it down
+        if (scale > 1 && cc > 0) {
+            pn->xc = pn->dark_xc;
+            pn->yc = pn->dark_yc;
         }
 
         // Close black pixel counts are a good indicator
-        range = ideal_count / 8;
-        max = ideal_count + range;
-        min = ideal_count - range;
+        range = full_count / 8;
+        max = full_count + range;
+        min = full_count - range;
         if (cc >= min && cc <= max)
             pn->score += 10;
 
-        DPRINTF("ant_score: ideal: %d min: %d max: %d cc: %d\n",
-               ideal_count, min, max, cc);
+        DPRINTF("ant_score: ideal: %d min: %d max: %d cc: %d elong: %4.2lf\n",
+               ideal_count, min, max, cc, pn->elong);
     }
 }
 
@@ -144,17 +137,22 @@ void ants::score_ants(struct rec_list *precs)
 }
 
 ants::ants(hw *phw, Mat *pframe, Mat *pfg, Mat *phalf_fg,
+           struct fg_occupancy *pocc,
            snapshots *psnap, image_classifier *pclass)
 {
     this->phw = phw;
     this->pframe = pframe;
     this->pfg = pfg;
     this->phalf_fg = phalf_fg;
+    this->pocc = pocc;
     this->psnap = psnap;
     this->pclass = pclass;
     pants = NULL;
+    memset(&class_stats, 0, sizeof(class_stats));
 
     // Set up pixel size table
+    delete [] ant_pix;
+    ant_pix = new uint16_t[PIX_TBL_WIDTH * PIX_TBL_HEIGHT];
     min_ant_size = 1000;
     max_ant_size = 0;
     for (int px = 0; px < PIX_TBL_WIDTH; px++) 
@@ -164,7 +162,7 @@ ants::ants(hw *phw, Mat *pframe, Mat *pfg, Mat *phalf_fg,
             ant_sq_pix *= ant_width * pixels_per_mm;
             assert(ant_sq_pix + 0.5 < 65536.0);
             uint16_t value = (uint16_t)(ant_sq_pix + 0.5);
-            ant_pix[px][py] = value;
+            ant_pix[px * PIX_TBL_HEIGHT + py] = value;
             if (value > max_ant_size)
                 max_ant_size = value;
             if (value < min_ant_size)
@@ -189,10 +187,13 @@ void ants::predict_next_pos(struct ant_list *pant, int *px, int *py)
     if (aspeed > 0.1) {
         DPRINTF("id %d predict_next_pos 0 %d %d\n", pant->id, pant->last.x, pant->last.y);
         // 1st guess is a minimum count of frames based on the state machine
-        pred.x = pant->last.x + uv.x * aspeed * lag * average_frame_time;
-        pred.y = pant->last.y + uv.y * aspeed * lag * average_frame_time;
-        DPRINTF("id %d predict_next_pos 1 %d %d lag: %5.2lf\n",
-                 pant->id, pred.x, pred.y, lag);
+        // plus how long ago the frame we last saw the ant in was captured
+        double age = (double)(now_ticks() - pant->last_frame_ticks)/tps;
+        double t = age + lag * average_frame_time;
+        pred.x = pant->last.x + uv.x * aspeed * t;
+        pred.y = pant->last.y + uv.y * aspeed * t;
+        DPRINTF("id %d predict_next_pos 1 %d %d lag: %5.2lf age: %5.3lf\n",
+                 pant->id, pred.x, pred.y, lag, age);
         assert(pred.x + pred.y != 0);
         // Next guess adds how far the ant moves while the mirrors
         // move rounded up to a full frame time 
@@ -204,7 +205,8 @@ void ants::predict_next_pos(struct ant_list *pant, int *px, int *py)
             DPRINTF("id %d predict_next_pos 2 %d %d move: %5.2lf\n", 
                     pant->id, pred.x, pred.y, move_frames);
         }
-        if (!Rect(0, 0, xpix, ypix).contains(pred)) {
+        // Don't lead the ant off the frame or into a keepout zone
+        if (phw->keepout(pred.x, pred.y, 1)) {
             pred.x = pant->last.x;
             pred.y = pant->last.y;
         }
@@ -241,15 +243,21 @@ void ants::match_blobs_to_ant(struct rec_list *precs, struct ant_list *pant)
     }
 }
 
+// Where pant should be in this frame
+Point ants::predict(struct ant_list *pant)
+{
+    double aspeed = pant->avg_speed.average();
+    Point2d uv = pant->uv.average();
+    double dt = (double)(frame_ticks - pant->last_frame_ticks)/tps;
+    return Point(pant->last.x + uv.x * aspeed * dt,
+                 pant->last.y + uv.y * aspeed * dt);
+}
+
 void ants::match_blobs_to_ants(struct rec_list *precs, struct ant_list *pants)
 {
     struct ant_list *pant;
     for (pant = pants; pant; pant = pant->next) {
-        double aspeed = pant->avg_speed.average();
-        Point2d uv = pant->uv.average();
-        int frames = frame_index - pant->last_frame;
-        pant->pred.x = pant->last.x + uv.x * aspeed * frames * average_frame_time;
-        pant->pred.y = pant->last.y + uv.y * aspeed * frames * average_frame_time;
+        pant->pred = predict(pant);
         match_blobs_to_ant(precs, pant);
     }
 }
@@ -279,6 +287,7 @@ void ants::process_ant(struct rec_list *pn)
     int ldy = pant->last.y - phw->cur_loc.py;
     pant->laser_dist = sqrt((double)(ldx * ldx + ldy * ldy));
     pant->last_frame = frame_index;
+    keep_class(pant, pn);
     if (take_snapshots)
         psnap->snap_ant(pant->last);
 }
@@ -298,6 +307,8 @@ void ants::add_ant(struct rec_list *pn)
     pnew->total_distance = 0.0;
     pnew->next = pants;
     pnew->pred = Point(0, 0);
+    pnew->class_conf = 0.0f;
+    keep_class(pnew, pn);
     pants = pnew;
     if (take_snapshots)
         psnap->snap_ant(pnew->last);
@@ -376,26 +387,140 @@ void ants::plot_predictions(Mat &half)
     plot_each_prediction(half, pants);
 }
 
-struct ant_list* ants::select_ant()
+// Where each ant could be by now, find_bbb looks there first
+void ants::track_windows()
+{
+    windows.clear();
+    for (struct ant_list *pant = pants; pant; pant = pant->next) {
+        double dt = (double)(frame_ticks - pant->last_frame_ticks)/tps;
+        double speed = pant->avg_speed.average();
+        Point2d uv = pant->uv.average();
+        int x = pant->last.x + (int)(uv.x * speed * dt);
+        int y = pant->last.y + (int)(uv.y * speed * dt);
+        int r = close_blob + (int)(speed * dt);
+        windows.push_back(Rect(x - r, y - r, 2 * r, 2 * r));
+    }
+}
+
+// A CNN result the ant's blob can use without running the net again
+void ants::keep_class(struct ant_list *pant, struct rec_list *pn)
+{
+    if (!pn->image_type || pn->image_cached)
+        return;
+    std::copy(pn->image_type, pn->image_type + n_image_types,
+              pant->image_type);
+    pant->class_conf = pn->image_type[ant_index];
+    pant->class_frame = frame_index;
+    pant->class_npix = pn->npix;
+    pant->class_elong = pn->elong;
+    pant->class_bright = pn->bright;
+}
+
+// pant's result still holds for pn: recent, sure, and pn looks the same
+bool ants::class_fresh(struct ant_list *pant, struct rec_list *pn)
+{
+    if (pant->class_conf < class_min_conf)
+        return false;
+    if (frame_index - pant->class_frame >= (uint32_t)class_frames)
+        return false;
+    if (abs(pn->npix - pant->class_npix) >
+        class_npix_change * pant->class_npix)
+        return false;
+    if (fabs(pn->elong - pant->class_elong) >
+        class_elong_change * pant->class_elong)
+        return false;
+    // New bright pixels could be the laser on the ant
+    return pn->bright <= pant->class_bright;
+}
+
+/*
+ * Each ant's closest blob, by the same prediction select_ant matches
+ * with, gets the ant's last CNN result if it's still fresh. The CNN
+ * only runs on the rest.
+ */
+void ants::reuse_classes(struct rec_list *precs)
+{
+    for (struct ant_list *pant = pants; pant; pant = pant->next) {
+        Point pred = predict(pant);
+        struct rec_list *candidate = NULL;
+        double closest = close_blob;
+        for (struct rec_list *pn = precs; pn; pn = pn->pnext) {
+            if (pn->kind != blob_ant || pn->image_type)
+                continue;
+            Point w(pn->xc - pred.x, pn->yc - pred.y);
+            double dist = sqrt((double)(w.x * w.x + w.y * w.y));
+            if (dist <= closest) {
+                closest = dist;
+                candidate = pn;
+            }
+        }
+        if (!candidate || !class_fresh(pant, candidate))
+            continue;
+        float *pt = (float *)frame_mem.alloc(n_image_types * sizeof(float));
+        std::copy(pant->image_type, pant->image_type + n_image_types, pt);
+        candidate->image_type = pt;
+        candidate->image_cached = true;
+    }
+
+    uint32_t hits = 0;
+    uint32_t misses = 0;
+    for (struct rec_list *pn = precs; pn; pn = pn->pnext) {
+        if (pn->image_cached)
+            hits++;
+        else if (pn->kind != blob_neither)
+            misses++;
+    }
+    class_stats.frames++;
+    class_stats.hits += hits;
+    class_stats.misses += misses;
+    DPRINTF("class cache: %u hits, %u misses frame %d\n",
+            hits, misses, frame_index);
+}
+
+void ants::class_report()
+{
+    uint32_t n = class_stats.frames ? class_stats.frames : 1;
+    printf("class cache: %u frames, %5.2lf hits/frame, %5.2lf misses/frame, "
+           "%u CNN patches saved\n", class_stats.frames,
+           (double)class_stats.hits / n, (double)class_stats.misses / n,
+           class_stats.hits);
+}
+
+/*
+ * The one labeling pass of the frame. find_laser and select_ant both
+ * work from this list, it lasts until frame_mem is reset. With -N the
+ * CNN scores all the candidates here too, in one batch, except the
+ * ones their ant's last result covers.
+ */
+struct rec_list *ants::find_blobs()
+{
+    track_windows();
+    struct rec_list *precs = find_bbb(*pfg, Rect(0, 0, pfg->cols, pfg->rows),
+                                      phw->keepouts(), ant_thresh, pocc, pframe,
+                                      ant_color, &windows);
+    classify_blobs(precs, xpix / pfg->cols);
+    if (neural_class) {
+        reuse_classes(precs);
+        pclass->classify(pframe, precs);
+    }
+    return precs;
+}
+
+// Blobs are from find_blobs
+struct ant_list* ants::select_ant(struct rec_list *precs)
 {
-    // Find blobs in fg
-    struct rec_list *precs = find_bbb(*pfg, Rect(0, 0, pfg->cols, pfg->rows), phw, ant_thresh);
     // See if they look like ants
     score_ants(precs);
     // Match up the ones that look like ants
     match_blobs_to_ants(precs, pants);
-    // Process ants and make new ones.
-    while(precs) {
-        struct rec_list *pn = precs;
+    // Process ants and make new ones. The list goes with frame_mem.
+    for (struct rec_list *pn = precs; pn; pn = pn->pnext) {
         if (pn->score > 0) {
             if (pn->claimed)
                 process_ant(pn);
             else
                 add_ant(pn);
         }
-
-        precs = precs->pnext;
-        delete pn;
     }
 
     // Clean up dead ants
@@ -27,9 +27,23 @@ struct ant_list {
     uint32_t this_frame;
     uint32_t blobs_this_frame;
     double laser_dist;
+    // Last CNN result for this ant with -N, reused by its next blobs
+    float image_type[n_image_types];
+    float class_conf;                 // Its ant score, 0 for none yet
+    uint32_t class_frame;             // Frame the CNN ran on
+    int class_npix;                   // The blob it ran on
+    double class_elong;
+    int class_bright;
     struct ant_list *next;
 };
 
+// CNN passes the ant cache saved, with -N
+struct class_counts {
+    uint32_t frames;
+    uint32_t hits;                    // Blobs given their ant's result
+    uint32_t misses;                  // Blobs left for the CNN
+};
+
 // Tuning
 const int close_blob = 40;            // Max for how close a blob must be to an ant
 const int ant_ppf = 35;               // Pixels per frame, average
@@ -38,24 +52,39 @@ const double ant_len = 2.5;           // Actual length of an ideal ant in mm
 const double ant_width = ant_len/2.0; // Actual width of an ideal ant in mm
 const int ant_color = 80;             // Ideal color
 const int max_score = 50;
+const int class_frames = 8;           // Frames an ant's CNN result is good for
+const float class_min_conf = 0.9f;    // Ant score needed to reuse it
+const double class_npix_change = 0.25;  // Blob size change that reruns the CNN
+const double class_elong_change = 0.25; // Shape change that does the same
 
 class ants {
     public:
         ants(hw *phw, Mat *pframe, Mat *pfg, Mat *phalf_fg,
+             struct fg_occupancy *pocc,
              snapshots *psnap, image_classifier *pclass);
-        struct ant_list *select_ant();
+        struct rec_list *find_blobs();
+        struct ant_list *select_ant(struct rec_list *precs);
         void predict_next_pos(struct ant_list *pant, int *px, int *py);
         void draw_ants();
         void plot_predictions(Mat &half);
         struct ant_list *all_ants(void);
+        void class_report();
+        struct class_counts class_stats;
     private:
         hw *phw;
         Mat *pframe;
         Mat *pfg;
         Mat *phalf_fg;
+        struct fg_occupancy *pocc;
         snapshots *psnap;
         image_classifier *pclass;
         struct ant_list *pants;
+        std::vector<Rect> windows;      // Around each ant, for find_bbb
+        void track_windows();
+        Point predict(struct ant_list *pant);
+        bool class_fresh(struct ant_list *pant, struct rec_list *pn);
+        void reuse_classes(struct rec_list *precs);
+        void keep_class(struct ant_list *pant, struct rec_list *pn);
         void ant_score(struct rec_list *pn);
         void score_ants(struct rec_list *precs);
         struct ant_list *pick_best_ant(struct ant_list *pant);
@@ -67,12 +96,13 @@ class ants {
         void add_ant(struct rec_list *pn);
 };
 
-// Sizes of ants in sq pixels
+// Sizes of ants in sq pixels, in PTG pixel squares over the frame.
+// Built for the camera's resolution when ants is made.
 #define PTG 20
-#define PIX_TBL_WIDTH (xpix / PTG)
-#define PIX_TBL_HEIGHT (ypix / PTG)
-extern uint16_t ant_pix[PIX_TBL_WIDTH][PIX_TBL_HEIGHT];
+#define PIX_TBL_WIDTH ((xpix + PTG - 1) / PTG)
+#define PIX_TBL_HEIGHT ((ypix + PTG - 1) / PTG)
+extern uint16_t *ant_pix;
 inline uint8_t get_ant_size(int x, int y)
 {
-    return ant_pix[x/PTG][y/PTG];
+    return ant_pix[(x/PTG) * PIX_TBL_HEIGHT + y/PTG];
 }
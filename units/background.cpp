@@ -0,0 +1,319 @@
+/* 
+ * Copyright 2016 Robert Bond
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <iostream>
+#include <sys/time.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <math.h>
+#include <pthread.h>
+
+#include <vector>
+
+#include "opencv2/core/core.hpp"
+#include "opencv2/gpu/gpu.hpp"
+#include "opencv2/highgui/highgui.hpp"
+
+using namespace std;
+using namespace cv;
+using namespace cv::gpu;
+
+#include "hw.h"
+#include "vibe_cpu.h"
+#include "occupancy.h"
+#include "background.h"
+
+extern int frame_index;
+
+background::background()
+{
+    for (int ty = 0; ty < BG_TILES_Y; ty++)
+        for (int tx = 0; tx < BG_TILES_X; tx++)
+            nresets[ty][tx] = 0;
+    occ.count = NULL;
+    occ.bits = NULL;
+    check_model = false;
+    warm_model = false;
+    model_path = NULL;
+    saving = false;
+    pthread_mutex_init(&save_lock, NULL);
+}
+
+Rect background::tile(Mat &fg, int tx, int ty)
+{
+    int x0 = fg.cols * tx / BG_TILES_X;
+    int x1 = fg.cols * (tx + 1) / BG_TILES_X;
+    int y0 = fg.rows * ty / BG_TILES_Y;
+    int y1 = fg.rows * (ty + 1) / BG_TILES_Y;
+    return Rect(x0, y0, x1 - x0, y1 - y0);
+}
+
+// The limits are in frame pixels, fg may be smaller
+int background::reset_limit(Mat &fg, int pix)
+{
+    int scale = xpix / fg.cols;
+    return pix / (scale * scale);
+}
+
+/*
+ * fg pixels inside a reset tile. Occupancy tiles inside it give their
+ * counts. Reset tiles needn't line up with OCC_TILE, 1080 / 3 is 360
+ * rows, so the occupancy tiles on its edge are counted from fg, only
+ * the part inside r.
+ */
+int background::tile_pix(Mat &fg, Rect r)
+{
+    int n = 0;
+    for (int ty = r.y / OCC_TILE; ty * OCC_TILE < r.y + r.height; ty++) {
+        for (int tx = r.x / OCC_TILE; tx * OCC_TILE < r.x + r.width; tx++) {
+            int c = occ_tile(&occ, tx, ty);
+            if (c == 0)
+                continue;
+            Rect ot(tx * OCC_TILE, ty * OCC_TILE, OCC_TILE, OCC_TILE);
+            Rect in = ot & r;
+            if (in == (ot & Rect(0, 0, fg.cols, fg.rows)))
+                n += c;
+            else
+                n += countNonZero(fg(in));
+        }
+    }
+    return n;
+}
+
+// Which tiles to reset this frame
+bool background::blown_tiles(Mat &fg, bool blown[BG_TILES_Y][BG_TILES_X])
+{
+    int pix[BG_TILES_Y][BG_TILES_X];
+    int total = 0;
+    bool any = false;
+
+    for (int ty = 0; ty < BG_TILES_Y; ty++) {
+        for (int tx = 0; tx < BG_TILES_X; tx++) {
+            pix[ty][tx] = tile_pix(fg, tile(fg, tx, ty));
+            total += pix[ty][tx];
+        }
+    }
+    bool all = total > reset_limit(fg, frame_reset_pix);
+    if (all)
+        printf("Background frame reset!\n");
+    for (int ty = 0; ty < BG_TILES_Y; ty++) {
+        for (int tx = 0; tx < BG_TILES_X; tx++) {
+            blown[ty][tx] = all ||
+                            pix[ty][tx] > reset_limit(fg, tile_reset_pix);
+            if (blown[ty][tx] && !all)
+                printf("Background tile %d %d reset!\n", tx, ty);
+            any |= blown[ty][tx];
+        }
+    }
+    return any;
+}
+
+struct fg_occupancy *background::occupancy()
+{
+    return &occ;
+}
+
+/*
+ * One VIBE_GPU per tile, run on views of the full frame. With an
+ * active tile map, laid out like occ.bits, the tiles that miss it are
+ * skipped and come out empty.
+ */
+void background::apply_gpu(GpuMat &d_frame, GpuMat &d_fg, Mat &fg,
+                           const uint64_t *active)
+{
+    if (!occ.count)
+        occ_setup(&occ, d_frame.rows, d_frame.cols);
+
+    d_fg.create(d_frame.rows, d_frame.cols, CV_8UC1);
+    for (int ty = 0; ty < BG_TILES_Y; ty++) {
+        for (int tx = 0; tx < BG_TILES_X; tx++) {
+            Rect r = tile(fg, tx, ty);
+            GpuMat d_fg_tile = d_fg(r);
+            if (active && !occ_any(&occ, active, r))
+                d_fg_tile.setTo(Scalar(0));
+            else
+                gvibe[ty][tx](d_frame(r), d_fg_tile);
+        }
+    }
+
+    d_fg.download(fg);
+    occ_count(&occ, fg, Rect(0, 0, fg.cols, fg.rows));
+
+    bool blown[BG_TILES_Y][BG_TILES_X];
+    if (!blown_tiles(fg, blown)) {
+        occ_finish(&occ);
+        return;
+    }
+    for (int ty = 0; ty < BG_TILES_Y; ty++) {
+        for (int tx = 0; tx < BG_TILES_X; tx++) {
+            Rect r = tile(fg, tx, ty);
+            if (blown[ty][tx]) {
+                // The bg processing blew up...
+                gvibe[ty][tx].initialize(d_frame(r));
+                d_fg(r).setTo(Scalar(0));
+                Mat fg_tile = fg(r);
+                fg_tile = Scalar(0); // No pixels this frame
+                occ_count(&occ, fg, r);
+                nresets[ty][tx]++;
+            }
+        }
+    }
+    occ_finish(&occ);
+}
+
+// The cpu model can skip down to single occupancy tiles
+void background::apply_cpu(Mat &frame, Mat &fg, const uint64_t *active)
+{
+    if (!occ.count)
+        occ_setup(&occ, frame.rows, frame.cols);
+
+    if (check_model) {
+        check_model = false;
+        double m = cvibe.mismatch(frame);
+        warm_model = m < model_match_limit;
+        printf("Background model %s, %.1f%% fg\n",
+               warm_model ? "kept" : "doesn't match the scene", m * 100.0);
+        if (!warm_model)
+            cvibe.initialize(frame);
+    }
+
+    // The tile counts come out of the vibe pass itself
+    occ_clear(&occ);
+    cvibe(frame, fg, &occ, active);
+
+    bool blown[BG_TILES_Y][BG_TILES_X];
+    if (!blown_tiles(fg, blown)) {
+        occ_finish(&occ);
+        return;
+    }
+    for (int ty = 0; ty < BG_TILES_Y; ty++) {
+        for (int tx = 0; tx < BG_TILES_X; tx++) {
+            Rect r = tile(fg, tx, ty);
+            if (blown[ty][tx]) {
+                // The bg processing blew up...
+                cvibe.initialize(frame, r);
+                Mat fg_tile = fg(r);
+                fg_tile = Scalar(0); // No pixels this frame
+                occ_count(&occ, fg, r);
+                nresets[ty][tx]++;
+            }
+        }
+    }
+    occ_finish(&occ);
+}
+
+// fg came from the cache, resets are already in it
+void background::apply_cached(Mat &fg)
+{
+    if (!occ.count)
+        occ_setup(&occ, fg.rows, fg.cols);
+    occ_count(&occ, fg, Rect(0, 0, fg.cols, fg.rows));
+    occ_finish(&occ);
+}
+
+/*
+ * Only the cpu model can be saved, VIBE_GPU keeps its samples to
+ * itself. The model is checked against the first frame in apply_cpu.
+ */
+void background::load_model(const char *path)
+{
+    check_model = cvibe.load(path);
+}
+
+// True once a saved model has been checked and kept
+bool background::warm()
+{
+    return warm_model;
+}
+
+// Only writes the snapshot, the model itself keeps changing meanwhile
+void *background::save_thread(void *arg)
+{
+    background *pbg = (background *)arg;
+    VIBE_CPU::save_snapshot(pbg->model_path, &pbg->model_snap[0],
+                            pbg->model_snap.size());
+    pthread_mutex_lock(&pbg->save_lock);
+    pbg->saving = false;
+    pthread_mutex_unlock(&pbg->save_lock);
+    return NULL;
+}
+
+/*
+ * Copies the model here, between frames, and writes the copy in the
+ * background. Skipped if the last save is still going.
+ */
+void background::save_model(const char *path)
+{
+    pthread_mutex_lock(&save_lock);
+    bool busy = saving;
+    pthread_mutex_unlock(&save_lock);
+    if (busy)
+        return;
+    wait_model();
+
+    size_t len = cvibe.model_size();
+    if (len == 0)
+        return;
+    model_snap.resize(len);
+    cvibe.snapshot(&model_snap[0]);
+
+    model_path = path;
+    pthread_mutex_lock(&save_lock);
+    saving = true;
+    pthread_mutex_unlock(&save_lock);
+    if (pthread_create(&saver, NULL, save_thread, this) != 0) {
+        pthread_mutex_lock(&save_lock);
+        saving = false;
+        pthread_mutex_unlock(&save_lock);
+        model_path = NULL;
+    }
+}
+
+void background::wait_model()
+{
+    if (model_path)
+        pthread_join(saver, NULL);
+    model_path = NULL;
+}
+
+uint32_t background::resets(int tx, int ty)
+{
+    return nresets[ty][tx];
+}
+
+// Shows where the scene is unstable
+void background::dump_resets()
+{
+    printf("Background tile resets, frame %d:\n", frame_index);
+    for (int ty = 0; ty < BG_TILES_Y; ty++) {
+        for (int tx = 0; tx < BG_TILES_X; tx++)
+            printf(" %6u", nresets[ty][tx]);
+        printf("\n");
+    }
+}
+
+void background::release()
+{
+    wait_model();
+    for (int ty = 0; ty < BG_TILES_Y; ty++)
+        for (int tx = 0; tx < BG_TILES_X; tx++)
+            gvibe[ty][tx].release();
+    cvibe.release();
+}
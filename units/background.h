@@ -0,0 +1,68 @@
+/* 
+ * Copyright 2016 Robert Bond
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+// The frame is split into tiles that are reset separately
+#define BG_TILES_X 4
+#define BG_TILES_Y 3
+
+// A tile with more fg pixels than this has blown up. So has the
+// whole frame with more than frame_reset_pix, even if no one tile
+// is over, and every tile is reset. Frame pixels.
+const int tile_reset_pix = 1000;
+const int frame_reset_pix = 3000;
+
+// A saved model is kept if it calls less than this much of the frame fg
+const double model_match_limit = 0.02;
+
+/*
+ * Background subtraction for process_frame. Each tile is reseeded on
+ * its own when it blows up, so a shadow in one corner doesn't blind
+ * the rest of the frame. Along with the fg mask it keeps an occupancy
+ * map of the fg pixels for find_bbb.
+ */
+class background {
+    public:
+        background();
+        void apply_gpu(gpu::GpuMat &d_frame, gpu::GpuMat &d_fg, Mat &fg,
+                       const uint64_t *active = NULL);
+        void apply_cpu(Mat &frame, Mat &fg, const uint64_t *active = NULL);
+        void apply_cached(Mat &fg);
+        void load_model(const char *path);
+        bool warm();
+        void save_model(const char *path);
+        void wait_model();
+        struct fg_occupancy *occupancy();
+        uint32_t resets(int tx, int ty);
+        void dump_resets();
+        void release();
+    private:
+        gpu::VIBE_GPU gvibe[BG_TILES_Y][BG_TILES_X];
+        VIBE_CPU cvibe;
+        uint32_t nresets[BG_TILES_Y][BG_TILES_X];
+        struct fg_occupancy occ;
+        bool check_model;           // Loaded, not yet compared to a frame
+        bool warm_model;            // Loaded and kept
+        const char *model_path;
+        std::vector<uint8_t> model_snap;    // What the saver writes
+        pthread_t saver;
+        pthread_mutex_t save_lock;
+        bool saving;                        // Under save_lock
+        static void *save_thread(void *arg);
+        Rect tile(Mat &fg, int tx, int ty);
+        int tile_pix(Mat &fg, Rect r);
+        int reset_limit(Mat &fg, int pix);
+        bool blown_tiles(Mat &fg, bool blown[BG_TILES_Y][BG_TILES_X]);
+};
@@ -0,0 +1,694 @@
+/* 
+ * Copyright 2016 Robert Bond
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+/*
+ * Times the vision pipeline pieces, ms per frame.
+ * Checks the pixel kernels against plain C, then runs vibe, then
+ * find_bbb on the fg masks vibe made, then -H against full size, then
+ * the classifiers on images/.
+ * bench [-v] [movie]
+ * Uses synthetic 1280x960 frames if no movie is given, otherwise runs
+ * at the movie's size. Run it from units/ so ../images is found.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <dirent.h>
+#include <iostream>
+#include <sys/time.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <math.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "opencv2/core/core.hpp"
+#include "opencv2/gpu/gpu.hpp"
+#include "opencv2/highgui/highgui.hpp"
+#include "opencv2/imgproc/imgproc.hpp"
+
+using namespace std;
+using namespace cv;
+using namespace cv::gpu;
+
+#include "hw.h"
+#include "vibe_cpu.h"
+#include "occupancy.h"
+#include "blobs.h"
+#include "pool.h"
+#include "kernels.h"
+#include "neuro.h"
+#include "lenet.h"
+
+// options
+bool verbose = false;
+bool fake_laser = true;
+
+// For hw.cpp and blobs.cpp
+bool sql_backlash = false;
+bool draw_laser = false;
+bool rle_labeling = false;
+int frame_index = 0;
+
+struct option {
+    const char *opt;
+    bool *vbl;
+    const char *msg;
+} opts[] = {
+    { "-v", &verbose, "Verbose logging" },
+    { NULL, NULL, NULL }
+};
+
+const int bench_frames = 200;
+const int warmup_frames = 10;
+const int blob_masks = 50;            // fg masks kept for the blob bench
+const int blob_reps = 10;             // Times each mask is labeled
+const int kernel_frames = 20;
+const int kernel_dark = 80;           // ant_color
+const int half_hit_radius = 4;        // Frame pixels, -H vs full size ants
+const float class_batch_tol = 1e-4f;  // Batched vs one at a time scores
+// How far the built in engine may be from Caffe, percent correct per
+// image_type, and for float the scores themselves
+const double class_float_acc_tol = 0.1;
+const float class_float_score_tol = 1e-3f;
+const double class_int8_acc_tol = 1.0;
+
+// Labeled patches, a directory per image_type
+const char *images_dir = "../images";
+const char *image_dirs[n_image_types] = { "bg", "ant", "laser" };
+
+// Noise with a few dark ants wandering across it
+void make_frame(Mat &frame, int i)
+{
+    static uint32_t rng = 1;
+
+    frame.create(ypix, xpix, CV_8UC1);
+    for (int y = 0; y < ypix; y++) {
+        uint8_t *p = frame.ptr(y);
+        for (int x = 0; x < xpix; x++) {
+            rng ^= rng << 13;
+            rng ^= rng >> 17;
+            rng ^= rng << 5;
+            p[x] = 120 + (rng & 7);
+        }
+    }
+    for (int a = 0; a < 10; a++) {
+        Point p((a * 127 + i * 3) % xpix, (a * 89 + i * 2) % ypix);
+        circle(frame, p, 3, Scalar(40), -1);
+    }
+}
+
+bool get_frame(VideoCapture &cap, Mat &frame, int i)
+{
+    if (!cap.isOpened()) {
+        make_frame(frame, i);
+        return true;
+    }
+    return cap.read(frame) && !frame.empty();
+}
+
+// Every kernel version this cpu has against the plain C one, on rows
+// of real frames. Odd starts and lengths so the row ends get checked.
+void bench_kernels(VideoCapture &cap, const char *movie)
+{
+    const struct pix_kernels *pc = kernel_version(0);
+    vector<Mat> frames;
+    Mat frame;
+    double tps = getTickFrequency();
+
+    for (int i = 0; i < kernel_frames; i++) {
+        if (!get_frame(cap, frame, i))
+            break;
+        frames.push_back(frame.clone());
+    }
+    if (frames.empty()) {
+        printf("No frames from %s\n", movie);
+        return;
+    }
+
+    printf("kernels %dx%d, %d frames, using %s\n",
+           frames[0].cols, frames[0].rows, (int)frames.size(), kern->name);
+    for (int v = 0; kernel_version(v); v++) {
+        const struct pix_kernels *pk = kernel_version(v);
+        uint64_t mismatches = 0;
+        uint64_t sum = 0;
+        double time = 0.0;
+
+        for (size_t f = 0; f < frames.size(); f++) {
+            int64 t0 = getTickCount();
+            for (int y = 0; y < frames[f].rows; y++) {
+                const uint8_t *p = frames[f].ptr(y);
+                uint64_t xs;
+                sum += pk->sum_below(p, frames[f].cols, kernel_dark, &xs);
+                sum += pk->count_above(p, frames[f].cols, blob_bright);
+                sum += xs;
+            }
+            time += (getTickCount() - t0) / tps;
+
+            for (int y = 0; y < frames[f].rows; y++) {
+                int x = y % 17;
+                int n = frames[f].cols - x - y % 31;
+                const uint8_t *p = frames[f].ptr(y) + x;
+                uint64_t xs, xsc;
+
+                uint32_t c = pk->sum_below(p, n, kernel_dark, &xs);
+                if (c != pc->sum_below(p, n, kernel_dark, &xsc) || xs != xsc)
+                    mismatches++;
+                c = pk->sum_above(p, n, blob_bright, &xs);
+                if (c != pc->sum_above(p, n, blob_bright, &xsc) || xs != xsc)
+                    mismatches++;
+                c = pk->count_above(p, n, blob_bright);
+                if (c != pc->count_above(p, n, blob_bright))
+                    mismatches++;
+            }
+        }
+        printf("  %-6s %6.3lf ms/frame, %llu mismatches\n",
+               pk->name, time * 1000.0 / frames.size(),
+               (unsigned long long)mismatches);
+        DPRINTF("  %s sum %llu\n", pk->name, (unsigned long long)sum);
+    }
+}
+
+void bench_vibe(VideoCapture &cap, const char *movie)
+{
+    VIBE_CPU cvibe;
+    VIBE_CPU hvibe;
+    VIBE_GPU vibe;
+    Mat frame;
+    Mat fg;
+    Mat half;
+    double cpu_time = 0.0;
+    double gpu_time = 0.0;
+    double half_time = 0.0;
+    uint64_t cpu_fg = 0;
+    uint64_t gpu_fg = 0;
+    uint64_t half_fg = 0;
+    int n = 0;
+    double tps = getTickFrequency();
+
+    for (int i = 0; i < warmup_frames + bench_frames; i++) {
+        if (!get_frame(cap, frame, i))
+            break;
+
+        // Same work as process_frame: upload, subtract, download
+        int64 t0 = getTickCount();
+        GpuMat d_frame(frame);
+        GpuMat d_fg;
+        if (i == 0)
+            vibe.initialize(d_frame);
+        vibe(d_frame, d_fg);
+        d_fg.download(fg);
+        int64 t1 = getTickCount();
+        int gcount = countNonZero(fg);
+
+        if (i == 0)
+            cvibe.initialize(frame);
+        cvibe(frame, fg);
+        int64 t2 = getTickCount();
+        int ccount = countNonZero(fg);
+
+        // units -H -C
+        int64 t3 = getTickCount();
+        pyrDown(frame, half);
+        if (i == 0)
+            hvibe.initialize(half);
+        hvibe(half, fg);
+        int64 t4 = getTickCount();
+        int hcount = countNonZero(fg);
+
+        if (i < warmup_frames)
+            continue;
+        gpu_time += (t1 - t0) / tps;
+        cpu_time += (t2 - t1) / tps;
+        half_time += (t4 - t3) / tps;
+        gpu_fg += gcount;
+        cpu_fg += ccount;
+        half_fg += hcount;
+        n++;
+        DPRINTF("frame %d gpu fg %d cpu fg %d half fg %d\n",
+                i, gcount, ccount, hcount);
+    }
+    if (n == 0) {
+        printf("No frames from %s\n", movie);
+        return;
+    }
+
+    printf("vibe %dx%d, %d frames, %d cpu threads\n",
+           frame.cols, frame.rows, n, cvibe.nthreads);
+    printf("  gpu: %6.2lf ms/frame, %8.1lf fg pixels/frame\n",
+           gpu_time * 1000.0 / n, (double)gpu_fg / n);
+    printf("  cpu: %6.2lf ms/frame, %8.1lf fg pixels/frame\n",
+           cpu_time * 1000.0 / n, (double)cpu_fg / n);
+    printf("  cpu half: %6.2lf ms/frame, %8.1lf fg pixels/frame x 4\n",
+           half_time * 1000.0 / n, (double)half_fg * 4.0 / n);
+    vibe.release();
+    cvibe.release();
+    hvibe.release();
+}
+
+// find_bbb the way select_ant runs it, on fg masks from vibe
+void bench_blobs(VideoCapture &cap, const char *movie, const keepout_zones *pko)
+{
+    VIBE_CPU cvibe;
+    Mat frame;
+    Mat fg;
+    vector<Mat> masks;
+    struct fg_occupancy occ;
+    double tps = getTickFrequency();
+
+    for (int i = 0; (int)masks.size() < blob_masks; i++) {
+        if (!get_frame(cap, frame, i))
+            break;
+        if (i == 0)
+            cvibe.initialize(frame);
+        cvibe(frame, fg);
+        if (i >= warmup_frames)
+            masks.push_back(fg.clone());
+    }
+    if (masks.empty()) {
+        printf("No frames from %s\n", movie);
+        return;
+    }
+
+    occ_setup(&occ, masks[0].rows, masks[0].cols);
+    printf("find_bbb on %s %dx%d, %d masks x %d\n", movie,
+           masks[0].cols, masks[0].rows, (int)masks.size(), blob_reps);
+    for (int engine = 0; engine < 2; engine++) {
+        double blob_time = 0.0;
+        uint64_t nblobs = 0;
+        uint64_t npix = 0;
+        int n = 0;
+
+        rle_labeling = engine == 1;
+        for (int rep = 0; rep < blob_reps; rep++) {
+            for (size_t m = 0; m < masks.size(); m++) {
+                Mat &work = masks[m];
+                occ_count(&occ, work, Rect(0, 0, work.cols, work.rows));
+                occ_finish(&occ);
+
+                int64 t0 = getTickCount();
+                struct rec_list *precs =
+                    find_bbb(work, Rect(0, 0, work.cols, work.rows),
+                             pko, 100, &occ);
+                int64 t1 = getTickCount();
+
+                blob_time += (t1 - t0) / tps;
+                for (; precs; precs = precs->pnext) {
+                    npix += precs->npix;
+                    nblobs++;
+                }
+                frame_mem.reset();
+                n++;
+            }
+        }
+        printf("  %-5s %6.3lf ms/frame, %6.1lf blobs/frame, "
+               "%8.1lf blob pixels/frame\n", engine ? "rle" : "flood",
+               blob_time * 1000.0 / n, (double)nblobs / n, (double)npix / n);
+    }
+    bbb_report();
+    frame_mem.report();
+    rle_labeling = false;
+    cvibe.release();
+}
+
+// Every IMG_SIZE png in dir, gray, in name order
+void load_images(const string &dir, vector<Mat> &imgs)
+{
+    DIR *pd = opendir(dir.c_str());
+    if (!pd) {
+        printf("Can't open %s\n", dir.c_str());
+        return;
+    }
+    vector<string> names;
+    struct dirent *pe;
+    while ((pe = readdir(pd)) != NULL) {
+        string name = pe->d_name;
+        if (name.size() > 4 && name.compare(name.size() - 4, 4, ".png") == 0)
+            names.push_back(name);
+    }
+    closedir(pd);
+    sort(names.begin(), names.end());
+
+    for (size_t i = 0; i < names.size(); i++) {
+        Mat img = imread(dir + "/" + names[i], CV_LOAD_IMAGE_GRAYSCALE);
+        if (img.rows == IMG_SIZE && img.cols == IMG_SIZE)
+            imgs.push_back(img);
+    }
+}
+
+struct class_run {
+    const char *name;
+    bool int8;
+    double startup;                 // Seconds to build the classifier
+    double single;                  // Seconds per patch, one per pass
+    double batched;                 // Seconds per patch, class_max_batch
+    vector<float> scores;           // n_image_types per image, batched
+    float batch_diff;               // Most a batched score is off alone
+};
+
+void run_classifier(bool native, bool int8, const vector<Mat> &imgs,
+                    struct class_run *pr)
+{
+    double tps = getTickFrequency();
+    int n = imgs.size();
+
+    int64 t0 = getTickCount();
+    image_classifier ic(native, int8);
+    pr->startup = (getTickCount() - t0) / tps;
+    pr->name = ic.engine();
+    pr->int8 = int8;
+
+    vector<float> single((size_t)n * n_image_types, 0.0f);
+    pr->scores.assign((size_t)n * n_image_types, 0.0f);
+    vector<float *> souts(n);
+    vector<float *> outs(n);
+    for (int i = 0; i < n; i++) {
+        souts[i] = &single[(size_t)i * n_image_types];
+        outs[i] = &pr->scores[(size_t)i * n_image_types];
+    }
+
+    // One warm up pass so first call setup isn't timed
+    vector<Mat> batch(imgs.begin(), imgs.begin() + 1);
+    ic.score(batch, &souts[0]);
+
+    t0 = getTickCount();
+    for (int i = 0; i < n; i++) {
+        batch.assign(imgs.begin() + i, imgs.begin() + i + 1);
+        ic.score(batch, &souts[i]);
+    }
+    pr->single = (getTickCount() - t0) / tps / n;
+
+    // Full batches then a short one, so the input is reshaped both ways
+    t0 = getTickCount();
+    for (int i = 0; i < n; i += class_max_batch) {
+        int m = std::min(class_max_batch, n - i);
+        batch.assign(imgs.begin() + i, imgs.begin() + i + m);
+        ic.score(batch, &outs[i]);
+    }
+    pr->batched = (getTickCount() - t0) / tps / n;
+
+    pr->batch_diff = 0.0f;
+    for (size_t i = 0; i < single.size(); i++)
+        pr->batch_diff = std::max(pr->batch_diff,
+                                  fabsf(single[i] - pr->scores[i]));
+}
+
+// Ant candidates the way ant_score sees them, at the dark pixels
+static void ant_points(struct rec_list *precs, int scale, vector<Point> &pts)
+{
+    pts.clear();
+    classify_blobs(precs, scale);
+    for (struct rec_list *pn = precs; pn; pn = pn->pnext) {
+        if (pn->kind != blob_ant || pn->dark == 0)
+            continue;
+        pts.push_back(Point(pn->dark_xc, pn->dark_yc));
+    }
+}
+
+/*
+ * units -H against the full size pipeline on the same frames, both on
+ * the cpu. Each full size ant candidate is a hit if -H found one within
+ * half_hit_radius, and the error is how far off its nearest one is.
+ */
+void bench_half(VideoCapture &cap, const char *movie, const keepout_zones *pko)
+{
+    VIBE_CPU cvibe;
+    VIBE_CPU hvibe;
+    Mat frame;
+    Mat half;
+    Mat fg;
+    Mat hfg;
+    vector<Point> full_pts;
+    vector<Point> half_pts;
+    double full_time = 0.0;
+    double half_time = 0.0;
+    uint64_t nfull = 0;
+    uint64_t nhalf = 0;
+    uint64_t hits = 0;
+    double err_tot = 0.0;
+    double err_max = 0.0;
+    int n = 0;
+    double tps = getTickFrequency();
+
+    for (int i = 0; i < warmup_frames + bench_frames; i++) {
+        if (!get_frame(cap, frame, i))
+            break;
+
+        int64 t0 = getTickCount();
+        if (i == 0)
+            cvibe.initialize(frame);
+        cvibe(frame, fg);
+        struct rec_list *precs = find_bbb(fg, Rect(0, 0, fg.cols, fg.rows),
+                                          pko, 100, NULL, &frame,
+                                          kernel_dark);
+        ant_points(precs, 1, full_pts);
+        int64 t1 = getTickCount();
+
+        pyrDown(frame, half);
+        if (i == 0)
+            hvibe.initialize(half);
+        hvibe(half, hfg);
+        precs = find_bbb(hfg, Rect(0, 0, hfg.cols, hfg.rows),
+                         pko, 100, NULL, &frame, kernel_dark);
+        ant_points(precs, 2, half_pts);
+        int64 t2 = getTickCount();
+        frame_mem.reset();
+
+        if (i < warmup_frames)
+            continue;
+        full_time += (t1 - t0) / tps;
+        half_time += (t2 - t1) / tps;
+        nfull += full_pts.size();
+        nhalf += half_pts.size();
+        n++;
+        for (size_t a = 0; a < full_pts.size(); a++) {
+            double best = 1e9;
+            for (size_t b = 0; b < half_pts.size(); b++) {
+                int dx = full_pts[a].x - half_pts[b].x;
+                int dy = full_pts[a].y - half_pts[b].y;
+                best = std::min(best, sqrt((double)(dx * dx + dy * dy)));
+            }
+            if (best > half_hit_radius)
+                continue;
+            hits++;
+            err_tot += best;
+            err_max = std::max(err_max, best);
+        }
+    }
+    if (n == 0) {
+        printf("No frames from %s\n", movie);
+        return;
+    }
+
+    printf("half res vs full, %d frames, vibe and find_bbb on the cpu\n", n);
+    printf("  full: %6.2lf ms/frame, %6.2lf ants/frame\n",
+           full_time * 1000.0 / n, (double)nfull / n);
+    printf("  half: %6.2lf ms/frame, %6.2lf ants/frame\n",
+           half_time * 1000.0 / n, (double)nhalf / n);
+    printf("  %5.1lf%% of full size ants found within %d pixels, "
+           "error mean %4.2lf max %4.2lf pixels\n",
+           nfull ? hits * 100.0 / nfull : 100.0, half_hit_radius,
+           hits ? err_tot / hits : 0.0, err_max);
+    cvibe.release();
+    hvibe.release();
+}
+
+static int best_type(const float *ps)
+{
+    return std::max_element(ps, ps + n_image_types) - ps;
+}
+
+// Percent of each image_type's patches pr got right
+void class_accuracy(const struct class_run *pr, const vector<int> &labels,
+                    double *pacc)
+{
+    int right[n_image_types] = { 0 };
+    int total[n_image_types] = { 0 };
+
+    for (size_t i = 0; i < labels.size(); i++) {
+        total[labels[i]]++;
+        if (best_type(&pr->scores[i * n_image_types]) == labels[i])
+            right[labels[i]]++;
+    }
+    for (int t = 0; t < n_image_types; t++)
+        pacc[t] = total[t] ? right[t] * 100.0 / total[t] : 0.0;
+}
+
+/*
+ * The built in lenet, float and int8, against Caffe on the labeled
+ * patches in images/. The int8 scales come from the same patches and
+ * are saved to LENET_CALIB for units -q. Every engine's batched scores
+ * have to match scoring the patches one at a time, and the built in
+ * engine's accuracy per image_type has to be Caffe's to within
+ * class_float_acc_tol or class_int8_acc_tol. False if any check fails.
+ */
+bool bench_classifier()
+{
+    vector<Mat> imgs;
+    vector<int> labels;
+    bool ok = true;
+
+    if (access(LENET_WEIGHTS, R_OK) != 0) {
+        printf("No %s, skipping the classifiers\n", LENET_WEIGHTS);
+        return true;
+    }
+    for (int t = 0; t < n_image_types; t++) {
+        size_t n = imgs.size();
+        load_images(string(images_dir) + "/" + image_dirs[t], imgs);
+        labels.insert(labels.end(), imgs.size() - n, t);
+    }
+    if (imgs.empty()) {
+        printf("No images in %s\n", images_dir);
+        return false;
+    }
+
+    // Scales for int8
+    lenet net;
+    int plane = IMG_SIZE * IMG_SIZE;
+    vector<float> in((size_t)imgs.size() * plane);
+    for (size_t i = 0; i < imgs.size(); i++) {
+        Mat dest(IMG_SIZE, IMG_SIZE, CV_32FC1, &in[i * plane]);
+        imgs[i].convertTo(dest, CV_32FC1, 1, 0);
+    }
+    if (!net.load(LENET_WEIGHTS, IMG_SIZE, IMG_SIZE))
+        return false;
+    net.calibrate(&in[0], imgs.size());
+    if (!net.save_calibration(LENET_CALIB))
+        printf("Can't save %s\n", LENET_CALIB);
+
+    vector<struct class_run> runs;
+    struct class_run r;
+    run_classifier(true, false, imgs, &r);
+    runs.push_back(r);
+    run_classifier(true, true, imgs, &r);
+    runs.push_back(r);
+#ifndef NO_CAFFE
+    run_classifier(false, false, imgs, &r);
+    runs.push_back(r);
+#else
+    printf("Built without Caffe, the built in engine isn't checked against it\n");
+#endif
+
+    printf("classifier %d patches, %s %d %s %d %s %d\n", (int)imgs.size(),
+           image_dirs[0], (int)std::count(labels.begin(), labels.end(), 0),
+           image_dirs[1], (int)std::count(labels.begin(), labels.end(), 1),
+           image_dirs[2], (int)std::count(labels.begin(), labels.end(), 2));
+    const struct class_run *pcaffe = runs.size() > 2 ? &runs[2] : NULL;
+    double caffe_acc[n_image_types];
+    if (pcaffe)
+        class_accuracy(pcaffe, labels, caffe_acc);
+    for (size_t e = 0; e < runs.size(); e++) {
+        const struct class_run *pr = &runs[e];
+        double acc[n_image_types];
+        int agree = 0;
+        float diff = 0.0f;
+
+        class_accuracy(pr, labels, acc);
+        for (size_t i = 0; pcaffe && i < imgs.size(); i++) {
+            const float *ps = &pr->scores[i * n_image_types];
+            const float *pc = &pcaffe->scores[i * n_image_types];
+            if (best_type(ps) == best_type(pc))
+                agree++;
+            for (int t = 0; t < n_image_types; t++)
+                diff = std::max(diff, fabsf(ps[t] - pc[t]));
+        }
+        printf("  %-10s startup %7.1lf ms, %7.1lf us/patch single, "
+               "%7.1lf us/patch batched\n", pr->name, pr->startup * 1000.0,
+               pr->single * 1e6, pr->batched * 1e6);
+        printf("  %-10s correct", "");
+        for (int t = 0; t < n_image_types; t++)
+            printf(" %s %5.1lf%%", image_dirs[t], acc[t]);
+        if (pcaffe)
+            printf(", agrees with caffe %5.1lf%%, max diff %.4f",
+                   agree * 100.0 / imgs.size(), diff);
+        printf("\n");
+
+        // The built in engine has to do what Caffe does on images/
+        if (pcaffe && pr != pcaffe) {
+            double tol = pr->int8 ? class_int8_acc_tol : class_float_acc_tol;
+            bool same = pr->int8 || diff <= class_float_score_tol;
+            for (int t = 0; t < n_image_types; t++)
+                same = same && fabs(acc[t] - caffe_acc[t]) <= tol;
+            printf("  %-10s matches caffe: %s\n", "", same ? "ok" : "NO");
+            ok = ok && same;
+        }
+        bool batch_ok = pr->batch_diff <= class_batch_tol;
+        printf("  %-10s batched vs one at a time max diff %.2g %s\n", "",
+               pr->batch_diff, batch_ok ? "ok" : "MISMATCH");
+        ok = ok && batch_ok;
+    }
+    return ok;
+}
+
+int main(int argc, char* argv[])
+{
+    const char *movie = "synthetic";
+    VideoCapture cap;
+
+    ++argv;
+    while (--argc) {
+        bool is_opt = false;
+        for (struct option *p = opts; p->opt; p++) {
+            if (strcmp(*argv, p->opt) == 0) {
+                *p->vbl = true;
+                is_opt = true;
+                printf("%s\n", p->msg);
+            }
+        }
+        if (!is_opt)
+            movie = *argv;
+        argv++;
+    }
+
+    if (strcmp(movie, "synthetic") != 0) {
+        cap.open(movie);
+        if (!cap.isOpened()) {
+            printf("Can't open %s\n", movie);
+            exit(1);
+        }
+        if (!set_resolution((int)cap.get(CV_CAP_PROP_FRAME_WIDTH),
+                            (int)cap.get(CV_CAP_PROP_FRAME_HEIGHT)))
+            exit(1);
+    }
+
+    bench_kernels(cap, movie);
+
+    // Start the movie over for the next one
+    if (cap.isOpened())
+        cap.set(CV_CAP_PROP_POS_FRAMES, 0);
+    bench_vibe(cap, movie);
+
+    // Start the movie over for the next one
+    if (cap.isOpened())
+        cap.set(CV_CAP_PROP_POS_FRAMES, 0);
+    // Just the keepout zones, hw would take over the motors
+    keepout_zones *pko = new keepout_zones();
+    pko->load_keepout(KEEPOUT_FILE);
+    bench_blobs(cap, movie, pko);
+
+    // Start the movie over for the next one
+    if (cap.isOpened())
+        cap.set(CV_CAP_PROP_POS_FRAMES, 0);
+    bench_half(cap, movie, pko);
+
+    bool ok = bench_classifier();
+
+    exit(ok ? 0 : 1);
+}
@@ -0,0 +1,276 @@
+/* 
+ * Copyright 2016 Robert Bond
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+/*
+ * Checks find_bbb against the per-pixel flood fill it replaced, on
+ * random fg masks with keepout zones, at both scales. The old fill is
+ * kept here as the reference: it pushes every pixel's neighbors on a
+ * stack and tests keepout per neighbor. Every blob has to come out
+ * the same, moments included, and fg must not change. The run length
+ * labeler (-L) is held to the same list. Exits 1 on any mismatch.
+ */
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <vector>
+#include <algorithm>
+
+#include "opencv2/core/core.hpp"
+#include "opencv2/gpu/gpu.hpp"
+
+using namespace std;
+using namespace cv;
+
+#include "hw.h"
+#include "blobs.h"
+#include "pool.h"
+
+// What blobs.o and hw.o expect from units
+bool verbose = false;
+bool fake_laser = true;
+bool sql_backlash = false;
+bool draw_laser = false;
+bool rle_labeling = false;
+int frame_index = 0;
+
+const int test_masks = 200;
+const int test_thresh = 100;
+
+// Two zones that cut through blobs, in frame pixels
+const char *test_zones =
+    "100,100 400,120 380,300 90,280\n"
+    "700,500 1100,520 900,900\n";
+
+static int shown;                       // Mismatch lines printed
+
+struct pt {
+    int x;
+    int y;
+};
+
+/*
+ * The old add_blob, without its own pixel cap: find_bbb's budget is
+ * never reached on these masks. Returns the blob's sums in bs.
+ */
+static void old_fill(Mat &src, int x0, int y0, const keepout_zones *pko,
+                     int scale, struct blob_stats *bs)
+{
+    vector<struct pt> stack;
+    struct pt p;
+
+    stats_start(bs, x0, y0);
+    p.x = x0;
+    p.y = y0;
+    stack.push_back(p);
+    while (!stack.empty()) {
+        int x = stack.back().x;
+        int y = stack.back().y;
+        stack.pop_back();
+        if (src.at<uchar>(y, x) <= test_thresh)
+            continue;
+        src.at<uchar>(y, x) = test_thresh;
+        stats_run(bs, x, x, y);
+        if (y > 0 && src.at<uchar>(y-1, x) > test_thresh &&
+            !pko->keepout(x, y-1, scale)) {
+            p.x = x;
+            p.y = y-1;
+            stack.push_back(p);
+        }
+        if (x > 0 && src.at<uchar>(y, x-1) > test_thresh &&
+            !pko->keepout(x-1, y, scale)) {
+            p.x = x-1;
+            p.y = y;
+            stack.push_back(p);
+        }
+        if (y < src.rows-1 && src.at<uchar>(y+1, x) > test_thresh &&
+            !pko->keepout(x, y+1, scale)) {
+            p.x = x;
+            p.y = y+1;
+            stack.push_back(p);
+        }
+        if (x < src.cols-1 && src.at<uchar>(y, x+1) > test_thresh &&
+            !pko->keepout(x+1, y, scale)) {
+            p.x = x+1;
+            p.y = y;
+            stack.push_back(p);
+        }
+    }
+}
+
+// The old find_bbb scan over the whole mask, on a copy
+static struct rec_list *old_find(const Mat &fg, const keepout_zones *pko,
+                                 int scale)
+{
+    Mat work = fg.clone();
+    struct rec_list *precs = NULL;
+    struct blob_stats bs;
+
+    for (int y = 0; y < work.rows; y++) {
+        for (int x = 0; x < work.cols; x++) {
+            if (work.at<uchar>(y, x) <= test_thresh ||
+                pko->keepout(x, y, scale))
+                continue;
+            old_fill(work, x, y, pko, scale, &bs);
+            if (bs.npix < 3)
+                continue;
+            struct rec_list *pnr = stats_rec(&bs, scale);
+            pnr->pnext = precs;
+            precs = pnr;
+        }
+    }
+    return precs;
+}
+
+static bool rec_less(const struct rec_list *a, const struct rec_list *b)
+{
+    if (a->rect.y != b->rect.y)
+        return a->rect.y < b->rect.y;
+    if (a->rect.x != b->rect.x)
+        return a->rect.x < b->rect.x;
+    return a->npix < b->npix;
+}
+
+static void sorted(struct rec_list *precs, vector<struct rec_list *> &v)
+{
+    v.clear();
+    for (; precs; precs = precs->pnext)
+        v.push_back(precs);
+    sort(v.begin(), v.end(), rec_less);
+}
+
+static bool same_rec(const struct rec_list *a, const struct rec_list *b)
+{
+    return a->rect == b->rect && a->xc == b->xc && a->yc == b->yc &&
+           a->npix == b->npix && a->rejected == b->rejected &&
+           a->theta == b->theta && a->elong == b->elong;
+}
+
+// Returns how many blobs differ between the two lists
+static int compare(const char *name, int mask, struct rec_list *pref,
+                   struct rec_list *pnew)
+{
+    vector<struct rec_list *> ref;
+    vector<struct rec_list *> got;
+    int bad = 0;
+
+    sorted(pref, ref);
+    sorted(pnew, got);
+    if (ref.size() != got.size()) {
+        if (shown++ < 10)
+            printf("  %s: mask %d, %d blobs, the old fill found %d\n",
+                   name, mask, (int)got.size(), (int)ref.size());
+        return 1;
+    }
+    for (size_t i = 0; i < ref.size(); i++) {
+        if (same_rec(ref[i], got[i]))
+            continue;
+        bad++;
+        if (shown++ < 10)
+            printf("  %s: mask %d, blob at %d %d %d pixels, old %d %d %d\n",
+                   name, mask, got[i]->rect.x, got[i]->rect.y,
+                   got[i]->npix, ref[i]->rect.x, ref[i]->rect.y,
+                   ref[i]->npix);
+    }
+    return bad;
+}
+
+// Random blobs, some bigger than blob_max_pix, with holes in them.
+// Few enough that find_bbb stays inside its candidate and pixel budgets.
+static void make_mask(Mat &fg, int i)
+{
+    fg.setTo(Scalar(0));
+    int nb = 10 + rand() % (i % 3 == 0 ? 20 : 60);
+    for (int b = 0; b < nb; b++) {
+        int cx = rand() % fg.cols;
+        int cy = rand() % fg.rows;
+        int r = 1 + rand() % (i % 3 == 0 ? 30 : 8);
+        for (int y = std::max(0, cy - r); y <= cy + r && y < fg.rows; y++)
+            for (int x = std::max(0, cx - r); x <= cx + r && x < fg.cols; x++)
+                if (rand() % 8)
+                    fg.at<uchar>(y, x) = 50 + rand() % 206;
+    }
+}
+
+int main()
+{
+    char zones[] = "/tmp/blob_testXXXXXX";
+    keepout_zones ko;
+    int failed = 0;
+
+    int zfd = mkstemp(zones);
+    if (zfd < 0 || write(zfd, test_zones, strlen(test_zones)) !=
+                   (ssize_t)strlen(test_zones)) {
+        printf("blob_test: can't write %s\n", zones);
+        return 1;
+    }
+    close(zfd);
+    int nzones = ko.load_keepout(zones);
+    unlink(zones);
+    if (nzones != 2) {
+        printf("blob_test: keepout zones didn't load\n");
+        return 1;
+    }
+
+    printf("blob_test: %d masks at each scale against the old fill\n",
+           test_masks);
+    srand(1);
+    for (int scale = 1; scale <= 2; scale++) {
+        Mat fg(ypix / scale, xpix / scale, CV_8UC1);
+        Mat before;
+        int bad_flood = 0;
+        int bad_rle = 0;
+        int changed = 0;
+
+        for (int i = 0; i < test_masks; i++) {
+            make_mask(fg, i);
+            fg.copyTo(before);
+            Rect all(0, 0, fg.cols, fg.rows);
+            struct rec_list *pref = old_find(fg, &ko, scale);
+
+            // A cut off list can't match, the mask has to be made easier
+            struct bbb_counts limits = bbb_stats;
+            rle_labeling = false;
+            bad_flood += compare("flood", i, pref,
+                                 find_bbb(fg, all, &ko, test_thresh));
+            if (bbb_stats.candidates != limits.candidates ||
+                bbb_stats.pixels != limits.pixels) {
+                if (shown++ < 10)
+                    printf("  mask %d ran into find_bbb's limits\n", i);
+                failed++;
+            }
+            rle_labeling = true;
+            bad_rle += compare("rle", i, pref,
+                               find_bbb(fg, all, &ko, test_thresh));
+            for (int y = 0; y < fg.rows; y++) {
+                if (memcmp(fg.ptr(y), before.ptr(y), fg.cols) != 0) {
+                    changed++;
+                    break;
+                }
+            }
+            frame_mem.reset();
+        }
+        printf("  scale %d: flood %s, rle %s, fg %s\n", scale,
+               bad_flood ? "FAILED" : "ok", bad_rle ? "FAILED" : "ok",
+               changed ? "CHANGED" : "untouched");
+        failed += bad_flood + bad_rle + changed;
+    }
+    return failed ? 1 : 0;
+}
@@ -23,6 +23,9 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <new>
 
 #include "opencv2/core/core.hpp"
 #include "opencv2/gpu/gpu.hpp"
@@ -34,171 +37,446 @@ using namespace cv;
 #include "hw.h"
 #include "util.h"
 #include "blobs.h"
+#include "occupancy.h"
+#include "ccl.h"
+#include "pool.h"
+#include "kernels.h"
 
 extern int frame_index;
 
-struct pt_stack {
+// Seeds for the span fill. The stack only ever grows, so after the
+// first few frames add_blob doesn't allocate.
+struct span_seed {
     int x;
     int y;
-    struct pt_stack *next;
 };
 
-struct pt_stack *ps_top;
+static struct span_seed *seeds;
+static int seeds_size;
+static int nseeds;
 
-inline void push_pt(int x, int y)
+static inline void push_seed(int x, int y)
 {
-    pt_stack *ps = new pt_stack;
-    ps->x = x;
-    ps->y = y;
-    ps->next = ps_top;
-    ps_top = ps;
+    if (nseeds == seeds_size) {
+        seeds_size = seeds_size ? seeds_size * 2 : 4096;
+        seeds = (struct span_seed *)realloc(seeds,
+                                            seeds_size * sizeof(seeds[0]));
+    }
+    seeds[nseeds].x = x;
+    seeds[nseeds].y = y;
+    nseeds++;
 }
 
-inline bool pop_pt(int *px, int *py)
+// Fill pixels taken this find_bbb call, a bit each, so the fg mask
+// is never written. Rows vis_y0 to vis_y1 are cleared at the end of
+// the call, the rest is already zero.
+static uint64_t *visited;
+static size_t visited_size;
+static int vis_words;
+static int vis_y0;
+static int vis_y1;
+
+static void visit_start(int rows, int cols)
 {
-    struct pt_stack *tmp;
+    int words = (cols + 63) / 64;
+    size_t n = (size_t)words * rows;
 
-    if (ps_top == NULL)
-        return false;
-    *px = ps_top->x;
-    *py = ps_top->y;
-    tmp = ps_top;
-    ps_top = ps_top->next;
-    delete tmp;
-    return true;
+    if (n > visited_size || words != vis_words) {
+        if (n > visited_size) {
+            free(visited);
+            visited = (uint64_t *)malloc(n * sizeof(uint64_t));
+            visited_size = n;
+        }
+        memset(visited, 0, visited_size * sizeof(uint64_t));
+        vis_words = words;
+    }
+    vis_y0 = rows;
+    vis_y1 = -1;
 }
 
-inline struct rec_list *
-add_blob(Mat &src, int x0, int y0, struct rec_list *precs,
-         hw *phw, bool *error, int thresh, int scale)
+static void visit_end()
 {
-    int blob_left = src.cols;
-    int blob_top = src.rows;
-    int blob_right = 0;
-    int blob_bottom = 0;
-    uint64_t xtot = 0;
-    uint64_t ytot = 0;
-    uint32_t npix = 0;
-    int x;
-    int y;
-    struct rec_list *pnr;
+    if (vis_y1 >= vis_y0)
+        memset(visited + (size_t)vis_y0 * vis_words, 0,
+               (size_t)(vis_y1 - vis_y0 + 1) * vis_words * sizeof(uint64_t));
+}
 
-    ps_top = NULL;
-    if (src.at<uchar>(y0, x0) <= thresh)
-        return precs;
-    push_pt(x0, y0);
-    while (pop_pt(&x, &y)) {
-        if (src.at<uchar>(y, x) > thresh) {
-            src.at<uchar>(y, x) = thresh;
-            blob_left = std::min(x, blob_left);
-            blob_top = std::min(y, blob_top);
-            blob_right = std::max(x, blob_right);
-            blob_bottom = std::max(y, blob_bottom);
-            xtot += x;
-            ytot += y;
-            npix++;
-            if (npix > 2000) {
-                // Background subtract sucks 
-                int jx, jy;
-                while (pop_pt(&jx, &jy))
-                    ;
-                *error = true;
-                return precs;
-            }
-            if (y > 0 &&
-                src.at<uchar>(y-1, x) > thresh &&
-                !phw->keepout(x, y-1, scale))
-                push_pt(x, y-1);
-            if (x > 0 &&
-                src.at<uchar>(y, x-1) > thresh &&
-                !phw->keepout(x-1, y, scale))
-                push_pt(x-1, y);
-            if (y < src.rows-1 &&
-                src.at<uchar>(y+1, x) > thresh &&
-                !phw->keepout(x, y+1, scale))
-                push_pt(x, y+1);
-            if (x < src.cols-1 &&
-                src.at<uchar>(y, x+1) > thresh &&
-                !phw->keepout(x+1, y, scale))
-                push_pt(x+1, y);
-        }
+static inline bool is_visited(int x, int y)
+{
+    return (visited[(size_t)y * vis_words + (x >> 6)] >> (x & 63)) & 1;
+}
+
+// Marks pixels xl to xr of row y
+static inline void visit_span(int y, int xl, int xr)
+{
+    uint64_t *row = visited + (size_t)y * vis_words;
+    int wl = xl >> 6;
+    int wr = xr >> 6;
+    uint64_t ml = ~(uint64_t)0 << (xl & 63);
+    uint64_t mr = ~(uint64_t)0 >> (63 - (xr & 63));
+
+    if (wl == wr) {
+        row[wl] |= ml & mr;
+    } else {
+        row[wl] |= ml;
+        for (int w = wl + 1; w < wr; w++)
+            row[w] = ~(uint64_t)0;
+        row[wr] |= mr;
+    }
+    vis_y0 = std::min(vis_y0, y);
+    vis_y1 = std::max(vis_y1, y);
+}
+
+// Pushes one seed for each run of fill pixels in row y, xl to xr
+template <int S>
+static inline void seed_row(Mat &src, int y, int xl, int xr,
+                            const keepout_zones *pko, int thresh, int scale)
+{
+    const uint8_t *p = src.ptr(y);
+    bool in_run = false;
+
+    for (int x = xl; x <= xr; x++) {
+        bool fill = p[x] > thresh && !is_visited(x, y) &&
+                    !pko->keepout<S>(x, y, scale);
+        if (fill && !in_run)
+            push_seed(x, y);
+        in_run = fill;
     }
+}
+
+struct rec_list *new_rec()
+{
+    return new (frame_mem.alloc(sizeof(struct rec_list))) rec_list;
+}
+
+// Counts the frame pixels under fg pixels x0 to x1 of row y that are
+// darker than dark or brighter than blob_bright. The frame is full
+// size, fg may be smaller.
+void stats_frame(struct blob_stats *ps, const Mat &frame, int x0, int x1,
+                 int y, int scale, int dark)
+{
+    int fx = x0 * scale;
+    int n = (x1 + 1) * scale - fx;
 
-    if (npix < 3) {
-        *error = false;
-        return precs;
+    // dark is well under blob_bright, no pixel is both
+    for (int fy = y * scale; fy < (y + 1) * scale; fy++) {
+        const uint8_t *p = frame.ptr(fy) + fx;
+        uint64_t xs;
+        uint32_t c = kern->sum_below(p, n, dark, &xs);
+        ps->dark += c;
+        ps->dxtot += (uint64_t)fx * c + xs;
+        ps->dytot += (uint64_t)fy * c;
+        ps->bright += kern->count_above(p, n, blob_bright);
     }
+}
+
+// A new rec_list for the blob, converted to full image size
+struct rec_list *stats_rec(const struct blob_stats *ps, int scale)
+{
+    struct rec_list *pnr = new_rec();
+    uint32_t npix = ps->npix;
 
-    // convert to full image size
-    pnr = new rec_list;
-    pnr->rect.x = blob_left * scale;
-    pnr->rect.y = blob_top * scale;
-    pnr->rect.width = (blob_right - blob_left + 1) * scale;
-    pnr->rect.height = (blob_bottom - blob_top + 1) * scale;
-    pnr->xc = xtot * scale / npix;
-    pnr->yc = ytot * scale / npix;
+    pnr->rect.x = ps->x0 * scale;
+    pnr->rect.y = ps->y0 * scale;
+    pnr->rect.width = (ps->x1 - ps->x0 + 1) * scale;
+    pnr->rect.height = (ps->y1 - ps->y0 + 1) * scale;
+    pnr->xc = ps->xtot * scale / npix;
+    pnr->yc = ps->ytot * scale / npix;
     pnr->npix = npix;
     pnr->score = 0;
+    pnr->rejected = npix > (uint32_t)blob_max_pix;
     pnr->claimed = NULL;
-    pnr->pnext = precs;
-    precs = pnr;
+    pnr->pnext = NULL;
+
+    // Central moments, each pixel a unit square so a one pixel wide
+    // line still has some width
+    double mx = (double)ps->xtot / npix;
+    double my = (double)ps->ytot / npix;
+    double mu20 = (double)ps->xxtot / npix - mx * mx + 1.0 / 12.0;
+    double mu02 = (double)ps->yytot / npix - my * my + 1.0 / 12.0;
+    double mu11 = (double)ps->xytot / npix - mx * my;
+    double half_diff = (mu20 - mu02) / 2.0;
+    double d = sqrt(half_diff * half_diff + mu11 * mu11);
+    double l1 = (mu20 + mu02) / 2.0 + d;
+    double l2 = (mu20 + mu02) / 2.0 - d;
+    pnr->theta = 0.5 * atan2(2.0 * mu11, mu20 - mu02);
+    pnr->elong = l2 > 0.0 ? sqrt(l1 / l2) : 1.0;
+
+    pnr->dark = ps->dark;
+    pnr->dark_xc = ps->dark ? ps->dxtot / ps->dark : pnr->xc;
+    pnr->dark_yc = ps->dark ? ps->dytot / ps->dark : pnr->yc;
+    pnr->bright = ps->bright;
+    pnr->kind = pnr->rejected ? blob_neither : blob_ant;
+    pnr->image_type = NULL;
+    pnr->image_cached = false;
+    return pnr;
+}
+
+// Sorts out the laser from the ant candidates, needs the frame counts
+void classify_blobs(struct rec_list *precs, int scale)
+{
+    for (struct rec_list *pn = precs; pn; pn = pn->pnext) {
+        if (pn->rejected)
+            pn->kind = blob_neither;
+        else if (pn->npix * scale * scale > laser_min_pix &&
+                 pn->bright > laser_min_bright)
+            pn->kind = blob_laser;
+        else
+            pn->kind = blob_ant;
+    }
+}
+
+// One find_bbb call
+struct bbb_call {
+    Mat *pfg;
+    const keepout_zones *pko;
+    int thresh;
+    int scale;
+    const Mat *pframe;
+    int dark;
+    const struct fg_occupancy *pocc;
+    int num_blob;
+    int pix_left;
+    struct rec_list *precs;
+};
+
+/*
+ * Scanline flood fill of the 4 connected pixels > thresh around
+ * x0, y0. Each seed is grown into a whole span of the row, which is
+ * marked visited, and the rows above and below are searched for new
+ * seeds under it. The fg mask itself isn't touched. With a frame the dark and bright pixels under
+ * the blob are counted on the way. Returns false when the pixel budget runs out,
+ * the blob so far goes on the list as rejected.
+ * S is the scale, or 0 to take it from pc.
+ */
+template <int S>
+inline bool add_blob(struct bbb_call *pc, int x0, int y0)
+{
+    Mat &src = *pc->pfg;
+    const keepout_zones *pko = pc->pko;
+    int thresh = pc->thresh;
+    int scale = S ? S : pc->scale;
+    struct blob_stats bs;
+    struct rec_list *pnr;
+    bool ok = true;
+
+    nseeds = 0;
+    if (src.at<uchar>(y0, x0) <= thresh || is_visited(x0, y0))
+        return true;
+    stats_start(&bs, x0, y0);
+    push_seed(x0, y0);
+    while (nseeds) {
+        nseeds--;
+        int x = seeds[nseeds].x;
+        int y = seeds[nseeds].y;
+        const uint8_t *p = src.ptr(y);
+        if (is_visited(x, y))
+            continue;
+
+        int xl = x;
+        int xr = x;
+        while (xl > 0 && p[xl-1] > thresh && !is_visited(xl-1, y) &&
+               !pko->keepout<S>(xl-1, y, scale))
+            xl--;
+        while (xr < src.cols-1 && p[xr+1] > thresh && !is_visited(xr+1, y) &&
+               !pko->keepout<S>(xr+1, y, scale))
+            xr++;
+
+        visit_span(y, xl, xr);
+        stats_run(&bs, xl, xr, y);
+        if (pc->pframe)
+            stats_frame(&bs, *pc->pframe, xl, xr, y, scale, pc->dark);
+        pc->pix_left -= xr - xl + 1;
+        if (pc->pix_left < 0) {
+            // Background subtract sucks 
+            nseeds = 0;
+            ok = false;
+            break;
+        }
+
+        if (y > 0)
+            seed_row<S>(src, y-1, xl, xr, pko, thresh, scale);
+        if (y < src.rows-1)
+            seed_row<S>(src, y+1, xl, xr, pko, thresh, scale);
+    }
+
+    if (bs.npix < 3)
+        return ok;
+
+    pnr = stats_rec(&bs, scale);
+    if (!ok)
+        pnr->rejected = true;
+    if (pnr->rejected)
+        bbb_stats.rejected++;
+    pnr->pnext = pc->precs;
+    pc->precs = pnr;
 
     if (verbose) {
         cout << "Blob: " << pnr->rect.x << " " << pnr->rect.y;
         cout <<  " " << pnr->rect.width << "x" << pnr->rect.height;
-        cout << " npix: " << npix;
+        cout << " npix: " << pnr->npix;
+        cout << " elong: " << pnr->elong;
+        if (pnr->rejected)
+            cout << " rejected";
         cout << " frame_index: " << frame_index;
         cout << "\n";
     }
 
-    *error = false;
-    return precs;
+    return ok;
 }
 
-// Finds a list of blobs that  are > thresh in color
-struct rec_list *find_bbb(Mat& fg, Rect r, hw *phw, int thresh)
+// Starts a blob at each pixel > thresh in row y from xs to xe - 1.
+// Returns false when find_bbb should give up.
+template <int S>
+static bool scan_row(struct bbb_call *pc, int y, int xs, int xe)
 {
-    struct rec_list *precs = NULL;
     const int inc64 = sizeof(uint64_t);
-    int cols = fg.cols & ~(sizeof(uint64_t) - 1);
-    int num_blob = 0;
-    int scale = xpix / fg.cols;
+    Mat &fg = *pc->pfg;
+    uint8_t *pfg = fg.data + fg.step * y + xs;
 
+    for (int x = xs; x < xe; x += inc64, pfg += inc64) {
+        if (*(uint64_t *)pfg == 0)
+            continue;
+        for (int x1 = x; x1 < x + inc64 && x1 < xe; x1++) {
+            if (pc->pko->keepout<S>(x1, y, pc->scale))
+                continue;
+            if (fg.at<uchar>(y, x1) > pc->thresh && !is_visited(x1, y)) {
+                if (pc->num_blob++ >= blob_max_candidates) {
+                    DPRINTF("More than %d Blob candidates!\n",
+                            blob_max_candidates);
+                    bbb_stats.candidates++;
+                    return false;
+                }
+                if (!add_blob<S>(pc, x1, y)) {
+                    DPRINTF("Blob overflow!\n");
+                    bbb_stats.pixels++;
+                    return false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+// Scans r, only the tiles that have fg pixels with an occupancy map
+template <int S>
+static bool scan_rect(struct bbb_call *pc, Rect r)
+{
+    const struct fg_occupancy *pocc = pc->pocc;
     int xs = r.x;
     int xe = r.x + r.width;
     int ys = r.y;
     int ye = r.y + r.height;
 
-    for (int y = ys; y < ye; y++) {
-        uint8_t *pfg = fg.data + fg.step * y + xs;
-        int x;
-
-        for (int x = xs; x < xe; x += inc64, pfg += inc64) {
-            if (*(uint64_t *)pfg != 0) {
-                for (int x1 = x; x1 < x + inc64 && x1 < fg.cols; x1++) {
-                    if (phw->keepout(x1, y, scale))
-                        continue;
-                    if (fg.at<uchar>(y, x1) > thresh) {
-                        bool error;
-                        if (num_blob++ > 1000) {
-                            DPRINTF("More than 1000 Blob candidates!\n");
-                            goto bail;
-                        }
-                        precs = add_blob(fg, x1, y, precs, phw, &error, thresh, scale);
-                        if (error) {
-                            while (precs) {
-                                struct rec_list *pn = precs;
-                                precs = precs->pnext;
-                                delete pn;
-                            }
-                            DPRINTF("Blob overflow!\n");
-                            goto bail;
-                        }
-                    }
-                }
-            }
+    if (!pocc) {
+        for (int y = ys; y < ye; y++)
+            if (!scan_row<S>(pc, y, xs, xe))
+                return false;
+        return true;
+    }
+
+    for (int ty = ys / OCC_TILE; ty * OCC_TILE < ye; ty++) {
+        if (pocc->bits[ty] == 0)
+            continue;
+        int y0 = std::max(ys, ty * OCC_TILE);
+        int y1 = std::min(ye, (ty + 1) * OCC_TILE);
+        for (int tx = xs / OCC_TILE; tx * OCC_TILE < xe; tx++) {
+            if (!occupied(pocc, tx, ty))
+                continue;
+            int x0 = std::max(xs, tx * OCC_TILE);
+            int x1 = std::min(xe, (tx + 1) * OCC_TILE);
+            for (int y = y0; y < y1; y++)
+                if (!scan_row<S>(pc, y, x0, x1))
+                    return false;
+        }
+    }
+    return true;
+}
+
+// The flood fill marks what it finds as visited, so the whole rect
+// pass skips the blobs found near the tracks
+template <int S>
+static void scan_all(struct bbb_call *pc, Rect r,
+                     const std::vector<Rect> *near)
+{
+    if (near) {
+        for (size_t i = 0; i < near->size(); i++) {
+            Rect nr = fg_rect((*near)[i], pc->scale) & r;
+            if (nr.width > 0 && nr.height > 0 && !scan_rect<S>(pc, nr))
+                return;
         }
     }
-bail:
-    return precs;
+    scan_rect<S>(pc, r);
+}
+
+// The run length engine, started on first use
+static ccl rle;
+
+struct bbb_counts bbb_stats;
+
+void bbb_report()
+{
+    printf("find_bbb: %u calls, %u blobs rejected, %u over %d candidates, "
+           "%u over %d pixels, %u over %d runs\n",
+           bbb_stats.calls, bbb_stats.rejected,
+           bbb_stats.candidates, blob_max_candidates,
+           bbb_stats.pixels, blob_pix_budget,
+           bbb_stats.runs, ccl_max_runs);
+}
+
+/*
+ * Finds a list of blobs that  are > thresh in color
+ * With an occupancy map only the tiles that have fg pixels are scanned.
+ * With a frame each blob gets the count of frame pixels under it
+ * darker than dark, and brighter than blob_bright.
+ *
+ * The work is bounded. Blobs over blob_max_pix come back rejected,
+ * and when the candidate or pixel budget runs out the list so far is
+ * returned. near, in frame pixels, is scanned first so the blobs
+ * around the ants being tracked make the cut. fg is only read.
+ */
+struct rec_list *find_bbb(Mat& fg, Rect r,
+                          const keepout_zones *pko, int thresh,
+                          const struct fg_occupancy *pocc,
+                          const Mat *pframe, int dark,
+                          const std::vector<Rect> *near)
+{
+    struct bbb_call call;
+    int scale = xpix / fg.cols;
+
+    bbb_stats.calls++;
+    if (rle_labeling)
+        return rle.label(fg, r, pko, thresh, pocc, pframe, dark, near);
+
+    call.pfg = &fg;
+    call.pko = pko;
+    call.thresh = thresh;
+    call.scale = scale;
+    call.pframe = pframe;
+    call.dark = dark;
+    call.pocc = pocc;
+    call.num_blob = 0;
+    call.pix_left = blob_pix_budget / (scale * scale);
+    call.precs = NULL;
+    visit_start(fg.rows, fg.cols);
+
+    /*
+     * The common scales get their own copy of the fill. The frame size
+     * isn't a template parameter: the fill only sees it as loop bounds
+     * of r, which are different on every call anyway, so a copy per
+     * size would add code without taking anything out of the loops.
+     */
+    switch (scale) {
+    case 1:
+        scan_all<1>(&call, r, near);
+        break;
+    case 2:
+        scan_all<2>(&call, r, near);
+        break;
+    default:
+        scan_all<0>(&call, r, near);
+        break;
+    }
+    visit_end();
+    return call.precs;
 }
@@ -14,15 +14,133 @@
  * limitations under the License.
 */
 
+// Frame pixels brighter than this are counted as saturated
+const int blob_bright = 250;
+
+// What the shared labeling pass takes a blob for
+enum blob_kind {
+    blob_neither,               // Rejected
+    blob_ant,
+    blob_laser,                 // Big and full of saturated pixels
+};
+const int laser_min_pix = 80;         // Frame pixels
+const int laser_min_bright = 60;
+
+// Limits on one find_bbb call
+const int blob_max_pix = 2000;          // Bigger blobs come back rejected
+const int blob_max_candidates = 1000;
+const int blob_pix_budget = 200000;     // fg pixels the flood fill visits
+
 struct rec_list {
     Rect rect;
     int xc;
     int yc;
     int npix;
     int score;
+    bool rejected;              // Over blob_max_pix, or cut off
     struct ant_list *claimed;
     struct rec_list *pnext;
+    // Shape from the second moments, the same at any rotation
+    double theta;               // Long axis angle, radians
+    double elong;               // Long / short axis, >= 1
+    // Frame pixels under the blob darker than find_bbb's dark level
+    int dark;
+    int dark_xc;
+    int dark_yc;
+    int bright;                 // And brighter than blob_bright
+    enum blob_kind kind;
+    // With -N, one CNN score per image_type, in frame_mem
+    const float *image_type;
+    bool image_cached;          // From the ant's last result, not the CNN
+};
+
+// Running sums for one blob as the labeler finds its runs, fg pixels
+struct blob_stats {
+    int x0;
+    int x1;
+    int y0;
+    int y1;
+    uint64_t xtot;
+    uint64_t ytot;
+    uint64_t xxtot;
+    uint64_t yytot;
+    uint64_t xytot;
+    uint32_t npix;
+    uint32_t dark;
+    uint64_t dxtot;             // Frame coords of the dark pixels
+    uint64_t dytot;
+    uint32_t bright;
 };
 
+inline void stats_start(struct blob_stats *ps, int x, int y)
+{
+    memset(ps, 0, sizeof(*ps));
+    ps->x0 = x;
+    ps->x1 = x;
+    ps->y0 = y;
+    ps->y1 = y;
+}
+
+// Sum of x * x for x = 0 to k
+inline int64_t sum_sq(int64_t k)
+{
+    return k * (k + 1) * (2 * k + 1) / 6;
+}
+
+// Adds pixels x0 to x1 of row y
+inline void stats_run(struct blob_stats *ps, int x0, int x1, int y)
+{
+    int n = x1 - x0 + 1;
+    uint64_t sx = (uint64_t)(x0 + x1) * n / 2;
+
+    ps->x0 = std::min(ps->x0, x0);
+    ps->x1 = std::max(ps->x1, x1);
+    ps->y0 = std::min(ps->y0, y);
+    ps->y1 = std::max(ps->y1, y);
+    ps->xtot += sx;
+    ps->ytot += (uint64_t)y * n;
+    ps->xxtot += sum_sq(x1) - sum_sq(x0 - 1);
+    ps->yytot += (uint64_t)y * y * n;
+    ps->xytot += sx * y;
+    ps->npix += n;
+}
+
+void stats_frame(struct blob_stats *ps, const Mat &frame, int x0, int x1,
+                 int y, int scale, int dark);
+struct rec_list *stats_rec(const struct blob_stats *ps, int scale);
+void classify_blobs(struct rec_list *precs, int scale);
+
+struct fg_occupancy;
+
+// How often find_bbb ran into its limits
+struct bbb_counts {
+    uint32_t calls;
+    uint32_t rejected;          // Blobs over blob_max_pix
+    uint32_t candidates;        // Calls cut off at blob_max_candidates
+    uint32_t pixels;            // Calls out of blob_pix_budget
+    uint32_t runs;              // Calls over ccl_max_runs
+};
+
+extern struct bbb_counts bbb_stats;
+void bbb_report();
+
+// A frame rect in fg pixels
+inline Rect fg_rect(Rect r, int scale)
+{
+    return Rect(r.x / scale, r.y / scale,
+                (r.width + scale - 1) / scale, (r.height + scale - 1) / scale);
+}
+
+// rec_lists come from frame_mem and are gone at the end of the frame
+struct rec_list *new_rec();
+
+// Run length labeling instead of the flood fill
+extern bool rle_labeling;
+
 // Finds a list of blobs that might be ants
-struct rec_list *find_bbb(Mat& fg, Rect r, hw *phw, int thresh);
+struct rec_list *find_bbb(Mat& fg, Rect r,
+                          const keepout_zones *pko, int thresh,
+                          const struct fg_occupancy *pocc = NULL,
+                          const Mat *pframe = NULL, int dark = 0,
+                          const std::vector<Rect> *near = NULL);
+
@@ -0,0 +1,171 @@
+/* 
+ * Copyright 2016 Robert Bond
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <iostream>
+#include <sys/time.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <math.h>
+#include <assert.h>
+
+#include "opencv2/core/core.hpp"
+#include "opencv2/gpu/gpu.hpp"
+#include "opencv2/highgui/highgui.hpp"
+
+using namespace std;
+using namespace cv;
+
+#include "capture.h"
+
+/*
+ * The pipeline always gets the newest frame. Frames that were
+ * captured but never handed out are counted as dropped. Each slot
+ * is allocated once on the first grab and then reused, so the
+ * pipeline's frame shares its buffer with the ring slot it holds.
+ */
+
+capture::capture()
+{
+    latest = -1;
+    held = -1;
+    seq = 0;
+    last_seq = 0;
+    ndropped = 0;
+    running = false;
+    failed = false;
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&ready, NULL);
+}
+
+bool capture::open(int dev, int width, int height)
+{
+    if (!cap.open(dev))
+        return false;
+    cap.set(CV_CAP_PROP_FRAME_WIDTH, width);
+    cap.set(CV_CAP_PROP_FRAME_HEIGHT, height);
+
+    // Preallocate the ring from the first frame
+    if (!cap.read(ring[0]) || ring[0].empty())
+        return false;
+    if (ring[0].cols != width || ring[0].rows != height) {
+        printf("capture: asked for %dx%d, got %dx%d\n", width, height,
+               ring[0].cols, ring[0].rows);
+        return false;
+    }
+    for (int i = 1; i < CAPTURE_RING; i++)
+        ring[i].create(ring[0].rows, ring[0].cols, ring[0].type());
+
+    running = true;
+    if (pthread_create(&tid, NULL, run, this) != 0) {
+        printf("capture: can't start the capture thread\n");
+        running = false;
+        return false;
+    }
+    return true;
+}
+
+bool capture::isOpened()
+{
+    return running;
+}
+
+void *capture::run(void *arg)
+{
+    ((capture *)arg)->loop();
+    return NULL;
+}
+
+// Called with the lock held
+int capture::free_slot()
+{
+    for (int i = 0; i < CAPTURE_RING; i++)
+        if (i != latest && i != held)
+            return i;
+    assert(0);
+    return 0;
+}
+
+void capture::loop()
+{
+    while (running) {
+        pthread_mutex_lock(&lock);
+        int slot = free_slot();
+        pthread_mutex_unlock(&lock);
+
+        // Stamp at grab time, before the decode in retrieve
+        bool ok = cap.grab();
+        uint64_t t = getTickCount();
+        if (ok)
+            ok = cap.retrieve(ring[slot]);
+
+        pthread_mutex_lock(&lock);
+        if (!ok) {
+            failed = true;
+            pthread_cond_signal(&ready);
+            pthread_mutex_unlock(&lock);
+            break;
+        }
+        if (seq != last_seq)
+            ndropped++;
+        ticks[slot] = t;
+        latest = slot;
+        seq++;
+        pthread_cond_signal(&ready);
+        pthread_mutex_unlock(&lock);
+    }
+}
+
+// Waits for a frame newer than the last one read
+bool capture::read(Mat &frame, uint64_t *pticks)
+{
+    pthread_mutex_lock(&lock);
+    while (!failed && seq == last_seq)
+        pthread_cond_wait(&ready, &lock);
+    if (seq == last_seq) {
+        pthread_mutex_unlock(&lock);
+        frame.release();
+        return false;
+    }
+    held = latest;
+    last_seq = seq;
+    frame = ring[held];
+    *pticks = ticks[held];
+    pthread_mutex_unlock(&lock);
+    return true;
+}
+
+void capture::release()
+{
+    if (running) {
+        running = false;
+        pthread_join(tid, NULL);
+    }
+    cap.release();
+}
+
+uint32_t capture::dropped()
+{
+    return ndropped;
+}
+
+uint32_t capture::captured()
+{
+    return seq;
+}
@@ -0,0 +1,49 @@
+/* 
+ * Copyright 2016 Robert Bond
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#include <pthread.h>
+
+// One slot being filled, one ready, one in use by the pipeline
+#define CAPTURE_RING 3
+
+// Reads the camera on its own thread and hands out the newest frame
+class capture {
+    public:
+        capture();
+        bool open(int dev, int width, int height);
+        bool isOpened();
+        bool read(Mat &frame, uint64_t *pticks);
+        void release();
+        uint32_t dropped();
+        uint32_t captured();
+    private:
+        VideoCapture cap;
+        pthread_t tid;
+        pthread_mutex_t lock;
+        pthread_cond_t ready;
+        Mat ring[CAPTURE_RING];
+        uint64_t ticks[CAPTURE_RING];     // getTickCount() at grab time
+        int latest;                       // Newest filled slot, -1 if none
+        int held;                         // Slot owned by the pipeline
+        uint32_t seq;                     // Frames captured so far
+        uint32_t last_seq;                // seq of the last frame handed out
+        uint32_t ndropped;
+        volatile bool running;
+        bool failed;
+        static void *run(void *arg);
+        void loop();
+        int free_slot();
+};
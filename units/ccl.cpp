@@ -0,0 +1,467 @@
+/* 
+ * Copyright 2016 Robert Bond
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <iostream>
+#include <sys/time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "opencv2/core/core.hpp"
+
+using namespace std;
+using namespace cv;
+
+#include "hw.h"
+#include "blobs.h"
+#include "occupancy.h"
+#include "ccl.h"
+
+extern int frame_index;
+
+struct ccl_stripe {
+    ccl *pc;
+    int y0;                     // Rows y0 to y1 - 1
+    int y1;
+    struct ccl_run *runs;
+    int nruns;
+    int max_runs;
+    int base;                   // Index of runs[0] in the whole frame
+    int first_row_end;          // Runs in row y0
+    int last_row_start;         // First run in row y1 - 1
+    bool overflow;
+};
+
+ccl::ccl()
+{
+    nthreads = std::min(std::max(getNumberOfCPUs(), 1), 4);
+    stripes = NULL;
+    tids = NULL;
+    quit = false;
+    running = 0;
+    pfg = NULL;
+    pko = NULL;
+    thresh = 0;
+    scale = 1;
+    pocc = NULL;
+    pframe = NULL;
+    dark = 0;
+    parent = NULL;
+    blobs = NULL;
+    size = 0;
+}
+
+ccl::~ccl()
+{
+    release();
+}
+
+void ccl::release()
+{
+    stop_threads();
+    delete [] parent;
+    delete [] blobs;
+    parent = NULL;
+    blobs = NULL;
+    size = 0;
+}
+
+void ccl::start_threads()
+{
+    stripes = new ccl_stripe[nthreads];
+    for (int i = 0; i < nthreads; i++) {
+        stripes[i].pc = this;
+        stripes[i].max_runs = ccl_max_runs / nthreads;
+        stripes[i].runs = new ccl_run[stripes[i].max_runs];
+    }
+    quit = false;
+    pthread_barrier_init(&go, NULL, nthreads);
+    pthread_barrier_init(&done, NULL, nthreads);
+    tids = new pthread_t[nthreads];
+    for (int i = 1; i < nthreads; i++)
+        pthread_create(&tids[i], NULL, worker, &stripes[i]);
+    running = nthreads;
+}
+
+void ccl::stop_threads()
+{
+    if (!stripes)
+        return;
+    quit = true;
+    pthread_barrier_wait(&go);
+    for (int i = 1; i < running; i++)
+        pthread_join(tids[i], NULL);
+    pthread_barrier_destroy(&go);
+    pthread_barrier_destroy(&done);
+    for (int i = 0; i < running; i++)
+        delete [] stripes[i].runs;
+    delete [] stripes;
+    delete [] tids;
+    stripes = NULL;
+    tids = NULL;
+    running = 0;
+}
+
+void *ccl::worker(void *arg)
+{
+    struct ccl_stripe *ps = (struct ccl_stripe *)arg;
+    ccl *pc = ps->pc;
+
+    for (;;) {
+        pthread_barrier_wait(&pc->go);
+        if (pc->quit)
+            break;
+        pc->run_stripe(ps);
+        pthread_barrier_wait(&pc->done);
+    }
+    return NULL;
+}
+
+// Runs are cut at keepout pixels just like the flood fill stops there
+template <int S>
+inline bool ccl::add_run(struct ccl_stripe *ps, int x0, int x1, int y)
+{
+    int x = x0;
+    while (x <= x1) {
+        while (x <= x1 && pko->keepout<S>(x, y, scale))
+            x++;
+        int xs = x;
+        while (x <= x1 && !pko->keepout<S>(x, y, scale))
+            x++;
+        if (x == xs)
+            continue;
+        if (ps->nruns == ps->max_runs) {
+            ps->overflow = true;
+            return false;
+        }
+        struct ccl_run *pr = &ps->runs[ps->nruns];
+        pr->x0 = xs;
+        pr->x1 = x - 1;
+        pr->y = y;
+        pr->parent = ps->nruns;
+        ps->nruns++;
+    }
+    return true;
+}
+
+// Appends the runs of row y, only looking in occupied tiles.
+// S is the scale, or 0 for any scale.
+template <int S>
+void ccl::encode_row(struct ccl_stripe *ps, int y)
+{
+    const uint8_t *p = pfg->ptr(y);
+    int xs = roi.x;
+    int xe = roi.x + roi.width;
+    uint64_t bits = pocc ? pocc->bits[y / OCC_TILE] : ~0ULL;
+
+    int x = xs;
+    while (x < xe) {
+        // Skip to the next occupied tile
+        if (!((bits >> (x / OCC_TILE)) & 1)) {
+            x = (x / OCC_TILE + 1) * OCC_TILE;
+            continue;
+        }
+        if (p[x] <= thresh) {
+            if ((x & 7) == 0 && x + 8 <= xe) {
+                uint64_t w;
+                memcpy(&w, p + x, sizeof(w));
+                if (w == 0) {
+                    x += 8;
+                    continue;
+                }
+            }
+            x++;
+            continue;
+        }
+        int x0 = x;
+        while (x < xe && p[x] > thresh)
+            x++;
+        if (!add_run<S>(ps, x0, x - 1, y))
+            return;
+    }
+}
+
+static inline int32_t stripe_find(struct ccl_run *runs, int32_t a)
+{
+    while (runs[a].parent != a) {
+        runs[a].parent = runs[runs[a].parent].parent;
+        a = runs[a].parent;
+    }
+    return a;
+}
+
+// Labels one stripe, parents are indexes into the stripe's runs
+void ccl::run_stripe(struct ccl_stripe *ps)
+{
+    ps->nruns = 0;
+    ps->overflow = false;
+    ps->first_row_end = 0;
+    ps->last_row_start = 0;
+
+    int prev_start = 0;
+    int prev_end = 0;
+    for (int y = ps->y0; y < ps->y1; y++) {
+        int cur_start = ps->nruns;
+        if (scale == 1)
+            encode_row<1>(ps, y);
+        else if (scale == 2)
+            encode_row<2>(ps, y);
+        else
+            encode_row<0>(ps, y);
+        if (ps->overflow)
+            return;
+        int cur_end = ps->nruns;
+        if (y == ps->y0)
+            ps->first_row_end = cur_end;
+        ps->last_row_start = cur_start;
+
+        // Runs that overlap the row above are 4 connected
+        int a = prev_start;
+        int b = cur_start;
+        while (a < prev_end && b < cur_end) {
+            struct ccl_run *pa = &ps->runs[a];
+            struct ccl_run *pb = &ps->runs[b];
+            if (pa->x0 <= pb->x1 && pb->x0 <= pa->x1) {
+                // The older run stays the root
+                int32_t ra = stripe_find(ps->runs, a);
+                int32_t rb = stripe_find(ps->runs, b);
+                if (ra < rb)
+                    ps->runs[rb].parent = ra;
+                else if (rb < ra)
+                    ps->runs[ra].parent = rb;
+            }
+            if (pa->x1 < pb->x1)
+                a++;
+            else
+                b++;
+        }
+        prev_start = cur_start;
+        prev_end = cur_end;
+    }
+}
+
+int32_t ccl::find(int32_t a)
+{
+    while (parent[a] != a) {
+        parent[a] = parent[parent[a]];
+        a = parent[a];
+    }
+    return a;
+}
+
+void ccl::join(int32_t a, int32_t b)
+{
+    a = find(a);
+    b = find(b);
+    if (a < b)
+        parent[b] = a;
+    else if (b < a)
+        parent[a] = b;
+}
+
+// True if the blob touches one of the near rects, in frame pixels
+static bool near_blob(const struct blob_stats *pb,
+                      const std::vector<Rect> *near, int scale)
+{
+    Rect br(pb->x0, pb->y0, pb->x1 - pb->x0 + 1, pb->y1 - pb->y0 + 1);
+    for (size_t i = 0; i < near->size(); i++) {
+        Rect nr = fg_rect((*near)[i], scale) & br;
+        if (nr.width > 0 && nr.height > 0)
+            return true;
+    }
+    return false;
+}
+
+// Labels each near rect on its own, for when the frame has too many runs
+struct rec_list *ccl::label_near(Mat &fg, Rect r,
+                                 const keepout_zones *pko, int thresh,
+                                 const struct fg_occupancy *pocc,
+                                 const Mat *pframe, int dark,
+                                 const std::vector<Rect> &near)
+{
+    struct rec_list *precs = NULL;
+    int scale = xpix / fg.cols;
+
+    for (size_t i = 0; i < near.size(); i++) {
+        Rect nr = fg_rect(near[i], scale) & r;
+        if (nr.width <= 0 || nr.height <= 0)
+            continue;
+        struct rec_list *pn = label(fg, nr, pko, thresh, pocc, pframe, dark);
+        while (pn) {
+            struct rec_list *pnext = pn->pnext;
+            // Near rects can overlap
+            bool dup = false;
+            for (struct rec_list *pd = precs; pd && !dup; pd = pd->pnext)
+                dup = pd->rect == pn->rect && pd->npix == pn->npix;
+            if (!dup) {
+                pn->pnext = precs;
+                precs = pn;
+            }
+            pn = pnext;
+        }
+    }
+    return precs;
+}
+
+/*
+ * Same blobs as the flood fill in find_bbb: rect, centroid and npix
+ * in frame pixels, blobs under 3 pixels dropped, blobs over
+ * blob_max_pix rejected, and at most blob_max_candidates. Blobs are
+ * clipped to r, where the flood fill follows a blob out of r.
+ *
+ * With too many candidates the ones touching near go first. With more
+ * than ccl_max_runs only the near rects are labeled.
+ */
+struct rec_list *ccl::label(Mat &fg, Rect r,
+                            const keepout_zones *pko, int thresh,
+                            const struct fg_occupancy *pocc,
+                            const Mat *pframe, int dark,
+                            const std::vector<Rect> *near)
+{
+    struct rec_list *precs = NULL;
+
+    r &= Rect(0, 0, fg.cols, fg.rows);
+    if (r.width <= 0 || r.height <= 0)
+        return NULL;
+    if (!stripes)
+        start_threads();
+    if (size < ccl_max_runs) {
+        delete [] parent;
+        delete [] blobs;
+        size = ccl_max_runs;
+        parent = new int32_t[size];
+        blobs = new blob_stats[size];
+    }
+
+    this->pfg = &fg;
+    this->roi = r;
+    this->pko = pko;
+    this->thresh = thresh;
+    this->scale = xpix / fg.cols;
+    this->pocc = pocc;
+    this->pframe = pframe;
+    this->dark = dark;
+
+    // Small regions aren't worth waking the threads for
+    int nstripes = r.height >= nthreads * OCC_TILE ? nthreads : 1;
+    for (int i = 0; i < nthreads; i++) {
+        struct ccl_stripe *ps = &stripes[i];
+        ps->y0 = r.y + r.height * i / nstripes;
+        ps->y1 = r.y + r.height * (i + 1) / nstripes;
+    }
+    if (nstripes == 1) {
+        run_stripe(&stripes[0]);
+    } else {
+        pthread_barrier_wait(&go);
+        run_stripe(&stripes[0]);
+        pthread_barrier_wait(&done);
+    }
+
+    // Stitch the stripes into one union find
+    int nruns = 0;
+    for (int i = 0; i < nstripes; i++) {
+        struct ccl_stripe *ps = &stripes[i];
+        if (ps->overflow) {
+            bbb_stats.runs++;
+            DPRINTF("ccl: more than %d runs, frame %d\n",
+                    ccl_max_runs, frame_index);
+            if (!near)
+                return NULL;
+            return label_near(fg, r, pko, thresh, pocc, pframe, dark, *near);
+        }
+        ps->base = nruns;
+        for (int j = 0; j < ps->nruns; j++)
+            parent[nruns + j] = nruns + ps->runs[j].parent;
+        nruns += ps->nruns;
+    }
+    for (int i = 1; i < nstripes; i++) {
+        struct ccl_stripe *pu = &stripes[i - 1];
+        struct ccl_stripe *pd = &stripes[i];
+        if (pu->nruns == 0 || pd->nruns == 0 ||
+            pu->runs[pu->nruns - 1].y != pd->y0 - 1 ||
+            pd->runs[0].y != pd->y0)
+            continue;
+        int a = pu->last_row_start;
+        int b = 0;
+        while (a < pu->nruns && b < pd->first_row_end) {
+            struct ccl_run *pa = &pu->runs[a];
+            struct ccl_run *pb = &pd->runs[b];
+            if (pa->x0 <= pb->x1 && pb->x0 <= pa->x1)
+                join(pu->base + a, pd->base + b);
+            if (pa->x1 < pb->x1)
+                a++;
+            else
+                b++;
+        }
+    }
+
+    // Roots are the first run of each blob in raster order
+    for (int i = 0; i < nstripes; i++) {
+        struct ccl_stripe *ps = &stripes[i];
+        for (int j = 0; j < ps->nruns; j++) {
+            struct ccl_run *pr = &ps->runs[j];
+            int32_t root = find(ps->base + j);
+            struct blob_stats *pb = &blobs[root];
+            if (root == ps->base + j)
+                stats_start(pb, pr->x0, pr->y);
+            stats_run(pb, pr->x0, pr->x1, pr->y);
+            if (pframe)
+                stats_frame(pb, *pframe, pr->x0, pr->x1, pr->y, scale, dark);
+        }
+    }
+
+    int nroots = 0;
+    for (int i = 0; i < nruns; i++)
+        if (parent[i] == i)
+            nroots++;
+    bool crowded = nroots > blob_max_candidates;
+    if (crowded) {
+        DPRINTF("More than %d Blob candidates!\n", blob_max_candidates);
+        bbb_stats.candidates++;
+    }
+
+    // When crowded, pass 0 takes the blobs near the tracks
+    int first_pass = crowded && near ? 0 : 1;
+    int num_blob = 0;
+    for (int pass = first_pass; pass < 2; pass++) {
+        for (int i = 0; i < nruns && num_blob < blob_max_candidates; i++) {
+            if (parent[i] != i)
+                continue;
+            struct blob_stats *pb = &blobs[i];
+            if (first_pass == 0 && near_blob(pb, near, scale) != (pass == 0))
+                continue;
+            num_blob++;
+            if (pb->npix < 3)
+                continue;
+
+            struct rec_list *pnr = stats_rec(pb, scale);
+            if (pnr->rejected) {
+                // Background subtract sucks 
+                DPRINTF("Blob overflow!\n");
+                bbb_stats.rejected++;
+            }
+            pnr->pnext = precs;
+            precs = pnr;
+        }
+    }
+    return precs;
+}
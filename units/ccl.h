@@ -0,0 +1,80 @@
+/* 
+ * Copyright 2016 Robert Bond
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#include <pthread.h>
+
+// More runs than this and only the windows near the tracks are labeled
+const int ccl_max_runs = 64000;
+
+struct ccl_run {
+    int16_t x0;                 // First and last pixel
+    int16_t x1;
+    int32_t y;
+    int32_t parent;             // Union find, index into the stripe
+};
+
+struct ccl_stripe;
+
+/*
+ * Run length connected components, an alternative to the flood fill
+ * in find_bbb. Rows are cut into runs of pixels > thresh, horizontal
+ * stripes are labeled in parallel with union find, then the stripes
+ * are joined at the seams. The fg mask is left alone.
+ */
+class ccl {
+    public:
+        ccl();
+        ~ccl();
+        struct rec_list *label(Mat &fg, Rect r,
+                               const keepout_zones *pko, int thresh,
+                               const struct fg_occupancy *pocc,
+                               const Mat *pframe = NULL, int dark = 0,
+                               const std::vector<Rect> *near = NULL);
+        void release();
+        int nthreads;
+    private:
+        struct ccl_stripe *stripes;
+        pthread_t *tids;
+        pthread_barrier_t go;
+        pthread_barrier_t done;
+        bool quit;
+        int running;                // Threads started
+        Mat *pfg;
+        Rect roi;
+        const keepout_zones *pko;
+        int thresh;
+        int scale;
+        const struct fg_occupancy *pocc;
+        const Mat *pframe;          // Dark pixel counts, if set
+        int dark;
+        int32_t *parent;            // Whole frame union find
+        struct blob_stats *blobs;   // Stats by root
+        int size;                   // Of parent and blobs
+        void start_threads();
+        void stop_threads();
+        static void *worker(void *arg);
+        struct rec_list *label_near(Mat &fg, Rect r,
+                                    const keepout_zones *pko, int thresh,
+                                    const struct fg_occupancy *pocc,
+                                    const Mat *pframe, int dark,
+                                    const std::vector<Rect> &near);
+        void run_stripe(struct ccl_stripe *ps);
+        template <int S> void encode_row(struct ccl_stripe *ps, int y);
+        template <int S> bool add_run(struct ccl_stripe *ps, int x0, int x1,
+                                      int y);
+        void join(int32_t a, int32_t b);
+        int32_t find(int32_t a);
+};
@@ -0,0 +1,218 @@
+/* 
+ * Copyright 2016 Robert Bond
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <iostream>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+
+#include "opencv2/core/core.hpp"
+
+using namespace std;
+using namespace cv;
+
+#include "fgcache.h"
+
+fg_cache::fg_cache()
+{
+    fd = -1;
+    reading = false;
+    width = 0;
+    height = 0;
+    path[0] = '\0';
+    tmp_path[0] = '\0';
+    base = NULL;
+    length = 0;
+    nhits = 0;
+}
+
+// Reads <movie>.fg if it is there, otherwise starts writing it
+bool fg_cache::open(const char *movie_path, int width, int height)
+{
+    struct stat st;
+    struct fgc_header hdr;
+
+    this->width = width;
+    this->height = height;
+    snprintf(path, sizeof(path), "%s.fg", movie_path);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.fg.tmp", movie_path);
+
+    fd = ::open(path, O_RDONLY);
+    if (fd >= 0 && fstat(fd, &st) == 0 &&
+        (size_t)st.st_size >= sizeof(hdr)) {
+        length = st.st_size;
+        base = (uint8_t *)mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (base == MAP_FAILED) {
+            printf("fg_cache: mmap of %s failed\n", path);
+            base = NULL;
+            drop_reader();
+            return false;
+        }
+        memcpy(&hdr, base, sizeof(hdr));
+        if (memcmp(hdr.magic, FGC_MAGIC, sizeof(hdr.magic)) != 0 ||
+            hdr.width != width || hdr.height != height) {
+            printf("fg_cache: %s doesn't match, ignoring it\n", path);
+            drop_reader();
+            return false;
+        }
+
+        // Index the records, stopping at a torn one
+        size_t off = sizeof(hdr);
+        while (off + sizeof(struct fgc_record) <= length) {
+            struct fgc_record *pr = (struct fgc_record *)(base + off);
+            size_t end = off + sizeof(*pr) + pr->nruns * sizeof(uint16_t);
+            if (end > length || pr->frame != offsets.size())
+                break;
+            offsets.push_back(off);
+            off = end;
+        }
+        reading = true;
+        printf("fg_cache: %u frames from %s\n", (uint32_t)offsets.size(), path);
+        return true;
+    }
+    if (fd >= 0)
+        ::close(fd);
+
+    fd = ::open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        printf("fg_cache: can't create %s\n", tmp_path);
+        return false;
+    }
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, FGC_MAGIC, sizeof(hdr.magic));
+    hdr.width = width;
+    hdr.height = height;
+    if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+        printf("fg_cache: can't write %s\n", tmp_path);
+        drop_writer();
+        return false;
+    }
+    runs.reserve(4096);
+    printf("fg_cache: writing %s\n", path);
+    return true;
+}
+
+bool fg_cache::loading()
+{
+    return reading;
+}
+
+bool fg_cache::load(uint32_t frame, Mat &fg)
+{
+    if (!reading || frame >= offsets.size())
+        return false;
+
+    struct fgc_record *pr = (struct fgc_record *)(base + offsets[frame]);
+    uint16_t *prun = (uint16_t *)(pr + 1);
+    uint16_t *pend = prun + pr->nruns;
+
+    fg.create(height, width, CV_8UC1);
+    for (int y = 0; y < height; y++) {
+        uint8_t *p = fg.ptr(y);
+        uint8_t *pe = p + width;
+        uint8_t v = 0;
+        while (p < pe && prun < pend) {
+            int n = *prun++;
+            memset(p, v, n);
+            p += n;
+            v ^= 255;
+        }
+    }
+    nhits++;
+    return true;
+}
+
+// Straight from the background stage, anything nonzero is fg
+void fg_cache::save(uint32_t frame, Mat &fg)
+{
+    if (reading || fd < 0)
+        return;
+
+    runs.clear();
+    for (int y = 0; y < fg.rows; y++) {
+        const uint8_t *p = fg.ptr(y);
+        const uint8_t *pe = p + fg.cols;
+        uint8_t v = 0;
+        while (p < pe) {
+            const uint8_t *ps = p;
+            while (p < pe && (*p != 0) == (v != 0))
+                p++;
+            runs.push_back((uint16_t)(p - ps));
+            v ^= 255;
+        }
+    }
+
+    struct fgc_record rec;
+    rec.frame = frame;
+    rec.nruns = runs.size();
+    struct iovec iov[2];
+    iov[0].iov_base = &rec;
+    iov[0].iov_len = sizeof(rec);
+    iov[1].iov_base = &runs[0];
+    iov[1].iov_len = runs.size() * sizeof(uint16_t);
+    ssize_t len = iov[0].iov_len + iov[1].iov_len;
+    if (writev(fd, iov, 2) != len) {
+        printf("fg_cache: write failed, not caching\n");
+        drop_writer();
+    }
+}
+
+// A finished cache only shows up under its real name
+void fg_cache::close()
+{
+    if (reading) {
+        drop_reader();
+        return;
+    }
+    if (fd >= 0) {
+        ::close(fd);
+        rename(tmp_path, path);
+    }
+    fd = -1;
+}
+
+// Lets go of the mapped cache, the file stays as it is
+void fg_cache::drop_reader()
+{
+    if (base)
+        munmap(base, length);
+    base = NULL;
+    if (fd >= 0)
+        ::close(fd);
+    fd = -1;
+    reading = false;
+    offsets.clear();
+}
+
+// Gives up on a cache being written, it never replaces the old one
+void fg_cache::drop_writer()
+{
+    if (fd >= 0)
+        ::close(fd);
+    fd = -1;
+    unlink(tmp_path);
+}
+
+uint32_t fg_cache::hits()
+{
+    return nhits;
+}
@@ -0,0 +1,60 @@
+/* 
+ * Copyright 2016 Robert Bond
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#define FGC_MAGIC "ANTFG01"
+
+struct fgc_header {
+    char magic[8];
+    int32_t width;
+    int32_t height;
+};
+
+// Each frame: this, then nruns uint16_t run lengths. Every row
+// alternates bg and fg runs, starting with bg, and adds up to width.
+struct fgc_record {
+    uint32_t frame;
+    uint32_t nruns;
+};
+
+/*
+ * Run length coded fg masks from a movie, kept next to it so replays
+ * can skip background subtraction. The first run over a movie writes
+ * the cache, later runs read it.
+ */
+class fg_cache {
+    public:
+        fg_cache();
+        bool open(const char *movie_path, int width, int height);
+        bool loading();
+        bool load(uint32_t frame, Mat &fg);
+        void save(uint32_t frame, Mat &fg);
+        void close();
+        uint32_t hits();
+    private:
+        int fd;
+        bool reading;
+        int width;
+        int height;
+        char path[256];
+        char tmp_path[256];
+        uint8_t *base;              // mmap when reading
+        size_t length;
+        vector<size_t> offsets;     // Record offset for each frame
+        vector<uint16_t> runs;      // Encode buffer
+        uint32_t nhits;
+        void drop_reader();
+        void drop_writer();
+};
@@ -23,16 +23,19 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <math.h>
+#include <string.h>
 
 #include "opencv2/core/core.hpp"
 #include "opencv2/gpu/gpu.hpp"
 #include "opencv2/highgui/highgui.hpp"
+#include "opencv2/imgproc/imgproc.hpp"
 
 using namespace std;
 using namespace cv;
 using namespace cv::gpu;
 
 #include "hw.h"
+#include "occupancy.h"
 
 struct coms {
     uint32_t magic;
@@ -78,7 +81,11 @@ struct coms {
 #define P2 0.000119739 
 #define P3 (-0.0227986)
 
-#define in_per_pix (0.00465 / 25.4)
+// The model is for the full 1280 pixel wide sensor. Smaller modes
+// bin its pixels, so they are scaled up into it. A different sensor
+// needs its own calibration.
+#define lens_xpix 1280
+#define in_per_pix (0.00465 / 25.4 * lens_xpix / xpix)
 #define camera_height (320.5 / 25.4)
 
 #define m1x 0.0
@@ -97,7 +104,8 @@ struct coms {
 // #define camera_to_mirrors_y 10.303022
 #define camera_to_mirrors_y 10.1
 
-// Step offsets from pixel pos 640, 480
+// Step offsets from the center of the frame, where set_home() zeroes
+// them. They are mirror travel, so they hold at any resolution.
 #define m1_max 345
 #define m1_min -380
 #define m2_max 980
@@ -116,7 +124,50 @@ extern bool fake_laser;
 extern bool sql_backlash;
 extern bool draw_laser;
 
+int xpix = default_xpix;
+int ypix = default_ypix;
+
+// Half size frames have to come out even, and the occupancy map has
+// one 64 bit word per row of tiles
+bool set_resolution(int cols, int rows)
+{
+    if (cols <= 0 || rows <= 0 || cols % 8 || rows % 8 ||
+        cols > 64 * OCC_TILE) {
+        printf("Can't run at %dx%d, sizes must be multiples of 8 "
+               "and at most %d wide\n", cols, rows, 64 * OCC_TILE);
+        return false;
+    }
+    xpix = cols;
+    ypix = rows;
+    return true;
+}
+
+// Keepout zones
+
+// Empty mask, only the frame edges are out
+static void keepout_setup(struct keepout_mask *pk, int scale)
+{
+    pk->cols = xpix / scale;
+    pk->rows = ypix / scale;
+    pk->words = (pk->cols + 63) / 64;
+    pk->bits = new uint64_t[pk->words * pk->rows];
+    memset(pk->bits, 0, pk->words * pk->rows * sizeof(uint64_t));
+}
+
+keepout_zones::keepout_zones()
+{
+    keepout_setup(&ko[0], 1);
+    keepout_setup(&ko[1], 2);
+}
+
+keepout_zones::~keepout_zones()
+{
+    delete [] ko[0].bits;
+    delete [] ko[1].bits;
+}
+
 // HW class
+
 hw::hw(backlash *pbl)
 {
     struct coms icoms;
@@ -438,23 +489,69 @@ bool hw::hw_idle()
  * much easier with the camera at 8.8mm
  */
 
-bool hw::keepout(int px, int py, int scale)
-{
-    if (scale == 2) {
-        px += px;
-        py += py;
-    } else if (scale != 1) {
-        px *= scale;
-        py *= scale;
+/*
+ * Reads keepout zones, one polygon per line as x,y pairs in frame
+ * pixels, # for comments, and rasterizes them into the masks. A
+ * missing file means no zones. Returns the number of zones.
+ */
+int keepout_zones::load_keepout(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+        return 0;
+
+    Mat zones(ypix, xpix, CV_8UC1, Scalar(0));
+    char line[1024];
+    int nzones = 0;
+    int lineno = 0;
+    while (fgets(line, sizeof(line), f)) {
+        vector<Point> poly;
+        char *p = line;
+        int x, y, n;
+        lineno++;
+        while (sscanf(p, " %d , %d%n", &x, &y, &n) == 2) {
+            poly.push_back(Point(x, y));
+            p += n;
+        }
+        while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')
+            p++;
+        if (poly.empty() && (*p == '#' || *p == 0))
+            continue;
+        if (poly.size() < 3 || (*p != '#' && *p != 0)) {
+            printf("%s:%d: bad keepout zone\n", path, lineno);
+            continue;
+        }
+        const Point *pts = &poly[0];
+        int npts = poly.size();
+        fillPoly(zones, &pts, &npts, 1, Scalar(255));
+        nzones++;
     }
-    
-    if (py < 0 || py > 959)
-        return true;
+    fclose(f);
+
+    // A pixel at scale s is out if its top left frame pixel is
+    for (int s = 1; s <= 2; s++) {
+        struct keepout_mask *pk = &ko[s - 1];
+        memset(pk->bits, 0, pk->words * pk->rows * sizeof(uint64_t));
+        for (int y = 0; y < pk->rows; y++) {
+            const uint8_t *pz = zones.ptr(y * s);
+            uint64_t *pb = pk->bits + y * pk->words;
+            for (int x = 0; x < pk->cols; x++)
+                if (pz[x * s])
+                    pb[x >> 6] |= 1ULL << (x & 63);
+        }
+    }
+    printf("%d keepout zones, %d pixels\n", nzones, countNonZero(zones));
+    return nzones;
+}
 
-    if (px < 0 || px > 1279)
-        return true;
+int hw::load_keepout(const char *path)
+{
+    return zones.load_keepout(path);
+}
 
-    return false;
+const keepout_zones *hw::keepouts()
+{
+    return &zones;
 }
 
 struct step_list {
@@ -14,8 +14,38 @@
  * limitations under the License.
 */
 
-#define xpix 1280
-#define ypix 960
+// Camera frame size, set from the camera or movie before hw is made
+extern int xpix;
+extern int ypix;
+const int default_xpix = 1280;
+const int default_ypix = 960;
+bool set_resolution(int cols, int rows);
+
+#define KEEPOUT_FILE "/home/rgb/keepout.txt"
+
+// One bit per pixel at a processing scale, set in keepout zones
+struct keepout_mask {
+    int cols;
+    int rows;
+    int words;                  // uint64_t per row
+    uint64_t *bits;
+};
+
+/*
+ * The keepout zones as masks at scales 1 and 2, sized for the camera
+ * when they're made. hw has one, and bench uses them without the rest
+ * of hw.
+ */
+class keepout_zones {
+    public:
+        keepout_zones();
+        ~keepout_zones();
+        bool keepout(int px, int py, int scale) const;
+        template <int S> bool keepout(int px, int py, int scale) const;
+        int load_keepout(const char *path);
+    private:
+        struct keepout_mask ko[2];  // Scale 1 and 2
+};
 
 struct loc {
     int px;             // Pixel coords
@@ -54,11 +84,14 @@ class hw {
         void shutdown(void);
         bool hw_idle(void);
         bool keepout(int px, int py, int scale);
+        int load_keepout(const char *path);
+        const keepout_zones *keepouts();
     private:
         volatile struct coms *pc;
         backlash *pbl;
         int m1_limit;
         int m2_limit;
+        keepout_zones zones;
 
         double px_to_xd(double px);
         double py_to_yd(double py);
@@ -96,5 +129,32 @@ class backlash {
         FILE *sql_out;
 };
 
+/*
+ * Outside the frame or in a keepout zone. S is the scale when the
+ * caller has it at compile time, then the mask is picked with no
+ * branch on scale. S is 0 for any scale.
+ */
+template <int S>
+inline bool keepout_zones::keepout(int px, int py, int scale) const
+{
+    if (S == 0 && scale > 2)
+        return keepout<1>(px * scale, py * scale, 1);
+    const struct keepout_mask *pk = &ko[(S ? S : scale) - 1];
+    if ((unsigned)px >= (unsigned)pk->cols ||
+        (unsigned)py >= (unsigned)pk->rows)
+        return true;
+    return (pk->bits[py * pk->words + (px >> 6)] >> (px & 63)) & 1;
+}
+
+inline bool keepout_zones::keepout(int px, int py, int scale) const
+{
+    return keepout<0>(px, py, scale);
+}
+
+inline bool hw::keepout(int px, int py, int scale)
+{
+    return zones.keepout<0>(px, py, scale);
+}
+
 extern bool verbose;
 #define DPRINTF if (verbose) printf
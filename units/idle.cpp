@@ -0,0 +1,139 @@
+/* 
+ * Copyright 2016 Robert Bond
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <iostream>
+#include <sys/time.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <math.h>
+
+#include "opencv2/core/core.hpp"
+#include "opencv2/imgproc/imgproc.hpp"
+
+using namespace std;
+using namespace cv;
+
+#include "hw.h"
+#include "idle.h"
+
+extern int frame_index;
+
+static const char *mode_labels[] = {
+    [mode_full] = "full",
+    [mode_idle] = "idle",
+};
+
+idle_gate::idle_gate()
+{
+    mode = mode_full;
+    quiet_frames = 0;
+    checks = 0;
+    have_prev = false;
+    for (int m = 0; m < nmodes; m++) {
+        frames[m] = 0;
+        busy_secs[m] = 0.0;
+    }
+    sleep_secs = 0.0;
+    nidles = 0;
+    nwakes = 0;
+    nrefresh = 0;
+}
+
+bool idle_gate::idle()
+{
+    return mode == mode_idle;
+}
+
+// Called after each full frame, idles after enough quiet ones
+void idle_gate::quiet(bool is_quiet)
+{
+    if (!is_quiet) {
+        quiet_frames = 0;
+        return;
+    }
+    if (++quiet_frames < idle_after_frames)
+        return;
+    DPRINTF("idle_gate: going idle, frame %d\n", frame_index);
+    mode = mode_idle;
+    quiet_frames = 0;
+    checks = 0;
+    have_prev = false;
+    nidles++;
+}
+
+// Compares against the last idle check, not the last full frame
+bool idle_gate::motion(const Mat &frame)
+{
+    resize(frame, small, Size(frame.cols / idle_scale,
+                              frame.rows / idle_scale), 0, 0, INTER_AREA);
+    if (!have_prev) {
+        small.copyTo(prev);
+        have_prev = true;
+        return false;
+    }
+    absdiff(small, prev, diff);
+    threshold(diff, diff, idle_diff, 255, THRESH_BINARY);
+    int changed = countNonZero(diff);
+    small.copyTo(prev);
+    return changed >= idle_motion_pix;
+}
+
+// The bg model still needs the odd frame so it follows the light
+bool idle_gate::refresh_bg()
+{
+    if (++checks < idle_bg_checks)
+        return false;
+    checks = 0;
+    nrefresh++;
+    return true;
+}
+
+void idle_gate::wake()
+{
+    DPRINTF("idle_gate: motion, waking up, frame %d\n", frame_index);
+    mode = mode_full;
+    quiet_frames = 0;
+    nwakes++;
+}
+
+// Time spent on this frame in the current mode
+void idle_gate::account(double busy, double slept)
+{
+    frames[mode]++;
+    busy_secs[mode] += busy;
+    sleep_secs += slept;
+}
+
+void idle_gate::report()
+{
+    double total = sleep_secs;
+    for (int m = 0; m < nmodes; m++)
+        total += busy_secs[m];
+    if (total <= 0.0)
+        return;
+
+    printf("Idle gate: %u idles, %u wakes, %u bg refreshes\n",
+           nidles, nwakes, nrefresh);
+    for (int m = 0; m < nmodes; m++)
+        printf("  %s: %u frames, %.1f s busy, %.1f%% of the time\n",
+               mode_labels[m], frames[m], busy_secs[m],
+               busy_secs[m] * 100.0 / total);
+    printf("  asleep: %.1f s, %.1f%% of the time\n",
+           sleep_secs, sleep_secs * 100.0 / total);
+}
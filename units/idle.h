@@ -0,0 +1,63 @@
+/* 
+ * Copyright 2016 Robert Bond
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+// Tuning for the idle mode
+const int idle_scale = 8;             // Motion check on 8x8 pixel averages
+const int idle_diff = 10;             // Average change that counts as motion
+const int idle_motion_pix = 2;        // Changed averages needed to wake up
+const int idle_fg_pix = 50;           // Less fg than this is quiet
+const int idle_after_frames = 150;    // Quiet full frames before idling
+const double idle_period = 0.2;       // Seconds between idle checks
+const int idle_bg_checks = 25;        // Idle checks between bg refreshes
+
+enum idle_mode {
+    mode_full,
+    mode_idle,
+    nmodes
+};
+
+/*
+ * When nothing has moved for a while the main loop idles: it only
+ * compares small downsampled frames a few times a second and sleeps in
+ * between. Any motion puts it back in the full pipeline on the same
+ * frame. Counts what each mode cost so the duty cycle shows up in the
+ * logs.
+ */
+class idle_gate {
+    public:
+        idle_gate();
+        bool idle();
+        void quiet(bool is_quiet);
+        bool motion(const Mat &frame);
+        bool refresh_bg();
+        void wake();
+        void account(double busy, double slept);
+        void report();
+    private:
+        enum idle_mode mode;
+        int quiet_frames;
+        int checks;                   // Idle checks since the last refresh
+        bool have_prev;
+        Mat small;
+        Mat prev;
+        Mat diff;
+        uint32_t frames[nmodes];
+        double busy_secs[nmodes];
+        double sleep_secs;
+        uint32_t nidles;              // Times we went idle
+        uint32_t nwakes;              // Times motion woke us up
+        uint32_t nrefresh;            // bg updates while idle
+};
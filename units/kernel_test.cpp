@@ -0,0 +1,106 @@
+/* 
+ * Copyright 2016 Robert Bond
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+/*
+ * Checks every pixel kernel version this cpu runs against the plain C
+ * one, bit for bit, on random rows. Starts and lengths are random so
+ * the vector loops and the row ends both get hit. Runs from make, no
+ * camera or movie needed. Exits 1 on any mismatch.
+ */
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kernels.h"
+
+const int test_buf = 4096;
+const int test_rows = 100000;
+const int test_max_len = 2048;          // Past a 1920 row
+
+// Noise, and flat stretches where every pixel passes or none do
+static void fill(uint8_t *buf, int n)
+{
+    for (int i = 0; i < n; i++)
+        buf[i] = rand();
+    for (int i = 0; i < 16; i++) {
+        int at = rand() % n;
+        int len = rand() % 200;
+        if (at + len > n)
+            len = n - at;
+        memset(buf + at, (rand() & 1) ? 0 : 255, len);
+    }
+}
+
+static int check(const struct pix_kernels *pk, const uint8_t *p, int n,
+                 uint8_t t)
+{
+    const struct pix_kernels *pc = kernel_version(0);
+    uint64_t xs, xsc;
+    int bad = 0;
+
+    if (pk->count_above(p, n, t) != pc->count_above(p, n, t))
+        bad++;
+    uint32_t c = pk->sum_below(p, n, t, &xs);
+    if (c != pc->sum_below(p, n, t, &xsc) || xs != xsc)
+        bad++;
+    c = pk->sum_above(p, n, t, &xs);
+    if (c != pc->sum_above(p, n, t, &xsc) || xs != xsc)
+        bad++;
+    static int shown;
+    if (bad && shown++ < 10)
+        printf("  %s: mismatch, %d pixels from %p threshold %d\n",
+               pk->name, n, p, t);
+    return bad;
+}
+
+int main()
+{
+    static uint8_t buf[test_buf];
+    int failed = 0;
+
+    srand(1);
+    fill(buf, test_buf);
+    printf("kernel_test: picked %s\n", kern->name);
+    for (int v = 1; kernel_version(v); v++) {
+        const struct pix_kernels *pk = kernel_version(v);
+        int bad = 0;
+
+        // Every length and start that ends a vector loop early
+        for (int n = 0; n <= 96; n++)
+            for (int x = 0; x < 32; x++)
+                bad += check(pk, buf + x, n, 128);
+        // Thresholds at the ends, where > and < can go wrong
+        for (int t = 0; t < 256; t += 51) {
+            bad += check(pk, buf, test_max_len, t);
+            bad += check(pk, buf + 1, test_max_len - 1, t);
+        }
+        for (int i = 0; i < test_rows; i++) {
+            int n = rand() % (test_max_len + 1);
+            int x = rand() % (test_buf - n + 1);
+            bad += check(pk, buf + x, n, rand());
+            if (i % 1000 == 0)
+                fill(buf, test_buf);
+        }
+        printf("  %-6s %s\n", pk->name, bad ? "FAILED" : "ok");
+        failed += bad;
+    }
+    if (!kernel_version(1))
+        printf("  only plain C on this cpu, nothing to compare\n");
+    return failed ? 1 : 0;
+}
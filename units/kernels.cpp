@@ -0,0 +1,263 @@
+/* 
+ * Copyright 2016 Robert Bond
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <string.h>
+#if defined(__arm__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+#include "kernels.h"
+
+/*
+ * The vector versions compare 16 or 32 pixels at once. The compare
+ * leaves 0xff in each byte that passes, and the counts and index sums
+ * come out of that 8 bytes at a time: masking with 0x01 (or the byte's
+ * index) and multiplying by 0x0101010101010101 adds the 8 bytes up into
+ * the top one. No byte sum gets past 255 so nothing carries.
+ */
+typedef uint8_t v16u8 __attribute__ ((vector_size (16)));
+#if defined(__x86_64__) || defined(__i386__)
+typedef uint8_t v32u8 __attribute__ ((vector_size (32)));
+#endif
+
+const uint64_t ones8 = 0x0101010101010101ULL;
+
+// Byte indexes 0 - 31 in 8 byte words
+static const uint64_t lane_index[4] = {
+    0x0706050403020100ULL,
+    0x0f0e0d0c0b0a0908ULL,
+    0x1716151413121110ULL,
+    0x1f1e1d1c1b1a1918ULL,
+};
+
+static inline uint32_t byte_sum(uint64_t w)
+{
+    return (w * ones8) >> 56;
+}
+
+// Plain C, also does the ends of rows for the others
+static uint32_t count_above_c(const uint8_t *p, int n, uint8_t t)
+{
+    uint32_t cnt = 0;
+    for (int i = 0; i < n; i++)
+        if (p[i] > t)
+            cnt++;
+    return cnt;
+}
+
+static uint32_t sum_below_c(const uint8_t *p, int n, uint8_t t,
+                            uint64_t *pxtot)
+{
+    uint32_t cnt = 0;
+    uint64_t xtot = 0;
+    for (int i = 0; i < n; i++) {
+        if (p[i] < t) {
+            cnt++;
+            xtot += i;
+        }
+    }
+    *pxtot = xtot;
+    return cnt;
+}
+
+static uint32_t sum_above_c(const uint8_t *p, int n, uint8_t t,
+                            uint64_t *pxtot)
+{
+    uint32_t cnt = 0;
+    uint64_t xtot = 0;
+    for (int i = 0; i < n; i++) {
+        if (p[i] > t) {
+            cnt++;
+            xtot += i;
+        }
+    }
+    *pxtot = xtot;
+    return cnt;
+}
+
+// Bytes of m that are 0xff, and the sum of their indexes
+template <class V>
+static inline __attribute__ ((always_inline))
+uint32_t mask_sums(const V &m, uint64_t *pxs)
+{
+    uint64_t w[sizeof(V) / 8];
+    uint32_t cnt = 0;
+    uint64_t xs = 0;
+
+    memcpy(w, &m, sizeof(w));
+    for (unsigned k = 0; k < sizeof(V) / 8; k++) {
+        cnt += byte_sum(w[k] & ones8);
+        xs += byte_sum(w[k] & lane_index[k]);
+    }
+    *pxs = xs;
+    return cnt;
+}
+
+template <class V>
+static inline __attribute__ ((always_inline))
+bool any(const V &m)
+{
+    uint64_t w[sizeof(V) / 8];
+    uint64_t or_all = 0;
+
+    memcpy(w, &m, sizeof(w));
+    for (unsigned k = 0; k < sizeof(V) / 8; k++)
+        or_all |= w[k];
+    return or_all != 0;
+}
+
+template <class V>
+static inline __attribute__ ((always_inline))
+uint32_t count_above_v(const uint8_t *p, int n, uint8_t t)
+{
+    const int w = sizeof(V);
+    V tv;
+    uint32_t cnt = 0;
+    int i = 0;
+
+    memset(&tv, t, sizeof(tv));
+    for (; i + w <= n; i += w) {
+        V v;
+        memcpy(&v, p + i, sizeof(v));
+        V m = (V)(v > tv);
+        if (!any(m))
+            continue;
+        uint64_t xs;
+        cnt += mask_sums(m, &xs);
+    }
+    return cnt + count_above_c(p + i, n - i, t);
+}
+
+// above picks > t, otherwise < t
+template <class V, bool above>
+static inline __attribute__ ((always_inline))
+uint32_t sum_v(const uint8_t *p, int n, uint8_t t, uint64_t *pxtot)
+{
+    const int w = sizeof(V);
+    V tv;
+    uint32_t cnt = 0;
+    uint64_t xtot = 0;
+    int i = 0;
+
+    memset(&tv, t, sizeof(tv));
+    for (; i + w <= n; i += w) {
+        V v;
+        memcpy(&v, p + i, sizeof(v));
+        V m = above ? (V)(v > tv) : (V)(v < tv);
+        if (!any(m))
+            continue;
+        uint64_t xs;
+        uint32_t c = mask_sums(m, &xs);
+        cnt += c;
+        xtot += (uint64_t)i * c + xs;
+    }
+
+    uint64_t xs;
+    uint32_t c = above ? sum_above_c(p + i, n - i, t, &xs) :
+                         sum_below_c(p + i, n - i, t, &xs);
+    *pxtot = xtot + (uint64_t)i * c + xs;
+    return cnt + c;
+}
+
+static uint32_t count_above_16(const uint8_t *p, int n, uint8_t t)
+{
+    return count_above_v<v16u8>(p, n, t);
+}
+
+static uint32_t sum_below_16(const uint8_t *p, int n, uint8_t t,
+                             uint64_t *pxtot)
+{
+    return sum_v<v16u8, false>(p, n, t, pxtot);
+}
+
+static uint32_t sum_above_16(const uint8_t *p, int n, uint8_t t,
+                             uint64_t *pxtot)
+{
+    return sum_v<v16u8, true>(p, n, t, pxtot);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__ ((target ("avx2")))
+static uint32_t count_above_32(const uint8_t *p, int n, uint8_t t)
+{
+    return count_above_v<v32u8>(p, n, t);
+}
+
+__attribute__ ((target ("avx2")))
+static uint32_t sum_below_32(const uint8_t *p, int n, uint8_t t,
+                             uint64_t *pxtot)
+{
+    return sum_v<v32u8, false>(p, n, t, pxtot);
+}
+
+__attribute__ ((target ("avx2")))
+static uint32_t sum_above_32(const uint8_t *p, int n, uint8_t t,
+                             uint64_t *pxtot)
+{
+    return sum_v<v32u8, true>(p, n, t, pxtot);
+}
+
+static const struct pix_kernels kernels_avx2 = {
+    "avx2", count_above_32, sum_below_32, sum_above_32
+};
+#endif
+
+static const struct pix_kernels kernels_c = {
+    "c", count_above_c, sum_below_c, sum_above_c
+};
+
+static const struct pix_kernels kernels_16 = {
+#if defined(__arm__) || defined(__aarch64__)
+    "neon",
+#else
+    "sse2",
+#endif
+    count_above_16, sum_below_16, sum_above_16
+};
+
+// Worst to best
+static const struct pix_kernels *versions[4];
+static int nversions;
+
+static const struct pix_kernels *pick_kernels()
+{
+    versions[nversions++] = &kernels_c;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2"))
+        versions[nversions++] = &kernels_16;
+    if (__builtin_cpu_supports("avx2"))
+        versions[nversions++] = &kernels_avx2;
+#elif defined(__arm__)
+    if (getauxval(AT_HWCAP) & HWCAP_NEON)
+        versions[nversions++] = &kernels_16;
+#elif defined(__aarch64__)
+    versions[nversions++] = &kernels_16;
+#endif
+    return versions[nversions - 1];
+}
+
+const struct pix_kernels *kern = pick_kernels();
+
+const struct pix_kernels *kernel_version(int i)
+{
+    if (i < 0 || i >= nversions)
+        return NULL;
+    return versions[i];
+}
@@ -0,0 +1,39 @@
+/* 
+ * Copyright 2016 Robert Bond
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+/*
+ * Pixel counting kernels shared by the blob stats, the laser center and
+ * the movie tools. Each works on one row of 8 bit pixels, p[0] through
+ * p[n-1], and there is a version for each vector unit the cpu might
+ * have. kern points at the fastest one this cpu runs, picked once at
+ * startup. They all give the same answers, bit for bit.
+ */
+struct pix_kernels {
+    const char *name;
+    // Pixels > t
+    uint32_t (*count_above)(const uint8_t *p, int n, uint8_t t);
+    // Pixels < t, *pxtot gets the sum of their indexes in p
+    uint32_t (*sum_below)(const uint8_t *p, int n, uint8_t t,
+                          uint64_t *pxtot);
+    // Pixels > t, *pxtot gets the sum of their indexes in p
+    uint32_t (*sum_above)(const uint8_t *p, int n, uint8_t t,
+                          uint64_t *pxtot);
+};
+
+extern const struct pix_kernels *kern;
+
+// The i'th version this cpu can run, 0 is plain C. NULL past the last.
+const struct pix_kernels *kernel_version(int i);
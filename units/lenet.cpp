@@ -0,0 +1,971 @@
+/* 
+ * Copyright 2016 Robert Bond
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON__) || defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+using namespace std;
+
+#include "lenet.h"
+
+// gcc maps these onto SSE2 on x86 and NEON on arm
+typedef float v4sf __attribute__ ((vector_size (16)));
+typedef int32_t v4si __attribute__ ((vector_size (16)));
+
+/*
+ * Just enough of the protobuf wire format to pull a NetParameter
+ * apart. Field numbers are from caffe.proto.
+ */
+struct pb_reader {
+    const uint8_t *p;
+    const uint8_t *end;
+    bool ok;
+};
+
+enum pb_wire {
+    pb_varint = 0,
+    pb_fixed64 = 1,
+    pb_bytes = 2,
+    pb_fixed32 = 5,
+};
+
+static uint64_t pb_read_varint(struct pb_reader *pr)
+{
+    uint64_t v = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (pr->p >= pr->end) {
+            pr->ok = false;
+            return 0;
+        }
+        uint8_t b = *pr->p++;
+        v |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80))
+            return v;
+    }
+    pr->ok = false;
+    return 0;
+}
+
+static float pb_read_float(struct pb_reader *pr)
+{
+    float f = 0.0f;
+    if (pr->end - pr->p < 4) {
+        pr->ok = false;
+        return f;
+    }
+    memcpy(&f, pr->p, sizeof(f));
+    pr->p += 4;
+    return f;
+}
+
+// The next field's number and wire type, false at the end
+static bool pb_next(struct pb_reader *pr, int *pfield, int *pwire)
+{
+    if (!pr->ok || pr->p >= pr->end)
+        return false;
+    uint64_t key = pb_read_varint(pr);
+    *pfield = key >> 3;
+    *pwire = key & 7;
+    return pr->ok;
+}
+
+// A length delimited field as a reader of its own
+static struct pb_reader pb_sub(struct pb_reader *pr)
+{
+    struct pb_reader sub;
+    uint64_t len = pb_read_varint(pr);
+
+    sub.ok = pr->ok && len <= (uint64_t)(pr->end - pr->p);
+    sub.p = pr->p;
+    sub.end = sub.ok ? pr->p + len : pr->p;
+    if (!sub.ok)
+        pr->ok = false;
+    pr->p = sub.end;
+    return sub;
+}
+
+static string pb_string(struct pb_reader *pr)
+{
+    struct pb_reader sub = pb_sub(pr);
+    return string((const char *)sub.p, sub.end - sub.p);
+}
+
+static void pb_skip(struct pb_reader *pr, int wire)
+{
+    switch (wire) {
+    case pb_varint:
+        pb_read_varint(pr);
+        break;
+    case pb_fixed64:
+        pr->p += 8;
+        break;
+    case pb_bytes:
+        pb_sub(pr);
+        break;
+    case pb_fixed32:
+        pr->p += 4;
+        break;
+    default:
+        pr->ok = false;
+        break;
+    }
+    if (pr->p > pr->end)
+        pr->ok = false;
+}
+
+// Repeated uint32s, packed or not. Only the first one counts here.
+static int pb_uint(struct pb_reader *pr, int wire)
+{
+    if (wire == pb_bytes) {
+        struct pb_reader sub = pb_sub(pr);
+        return sub.p < sub.end ? (int)pb_read_varint(&sub) : 0;
+    }
+    return (int)pb_read_varint(pr);
+}
+
+// Repeated floats, packed or not
+static void pb_floats(struct pb_reader *pr, int wire, vector<float> &v)
+{
+    if (wire == pb_fixed32) {
+        v.push_back(pb_read_float(pr));
+        return;
+    }
+    struct pb_reader sub = pb_sub(pr);
+    size_t n = (sub.end - sub.p) / 4;
+    size_t old = v.size();
+    v.resize(old + n);
+    if (n)
+        memcpy(&v[old], sub.p, n * 4);
+}
+
+// One LayerParameter, just the parts the engine uses
+struct caffe_layer {
+    string name;
+    string type;
+    vector<vector<float> > blobs;
+    int num_output;
+    bool bias_term;
+    int kernel;
+    int stride;
+    int pad;
+    int pool;                       // 0 MAX, 1 AVE
+    bool global;
+    int group;
+    bool transpose;
+    float slope;
+};
+
+static void parse_blob(struct pb_reader *pr, vector<float> &data)
+{
+    int field, wire;
+    while (pb_next(pr, &field, &wire)) {
+        if (field == 5)
+            pb_floats(pr, wire, data);
+        else
+            pb_skip(pr, wire);
+    }
+}
+
+// ConvolutionParameter, PoolingParameter and InnerProductParameter
+static void parse_conv(struct pb_reader *pr, struct caffe_layer *pl)
+{
+    int field, wire;
+    while (pb_next(pr, &field, &wire)) {
+        switch (field) {
+        case 1: pl->num_output = pb_uint(pr, wire); break;
+        case 2: pl->bias_term = pb_uint(pr, wire) != 0; break;
+        case 3: pl->pad = pb_uint(pr, wire); break;
+        case 4: pl->kernel = pb_uint(pr, wire); break;
+        case 5: pl->group = pb_uint(pr, wire); break;
+        case 6: pl->stride = pb_uint(pr, wire); break;
+        case 9: case 10: pl->pad = pb_uint(pr, wire); break;
+        case 11: case 12: pl->kernel = pb_uint(pr, wire); break;
+        case 13: case 14: pl->stride = pb_uint(pr, wire); break;
+        default: pb_skip(pr, wire); break;
+        }
+    }
+}
+
+static void parse_pool(struct pb_reader *pr, struct caffe_layer *pl)
+{
+    int field, wire;
+    while (pb_next(pr, &field, &wire)) {
+        switch (field) {
+        case 1: pl->pool = pb_uint(pr, wire); break;
+        case 2: case 5: case 6: pl->kernel = pb_uint(pr, wire); break;
+        case 3: case 7: case 8: pl->stride = pb_uint(pr, wire); break;
+        case 4: case 9: case 10: pl->pad = pb_uint(pr, wire); break;
+        case 12: pl->global = pb_uint(pr, wire) != 0; break;
+        default: pb_skip(pr, wire); break;
+        }
+    }
+}
+
+static void parse_ip(struct pb_reader *pr, struct caffe_layer *pl)
+{
+    int field, wire;
+    while (pb_next(pr, &field, &wire)) {
+        switch (field) {
+        case 1: pl->num_output = pb_uint(pr, wire); break;
+        case 2: pl->bias_term = pb_uint(pr, wire) != 0; break;
+        case 6: pl->transpose = pb_uint(pr, wire) != 0; break;
+        default: pb_skip(pr, wire); break;
+        }
+    }
+}
+
+static void parse_relu(struct pb_reader *pr, struct caffe_layer *pl)
+{
+    int field, wire;
+    while (pb_next(pr, &field, &wire)) {
+        if (field == 1 && wire == pb_fixed32)
+            pl->slope = pb_read_float(pr);
+        else
+            pb_skip(pr, wire);
+    }
+}
+
+static void parse_layer(struct pb_reader *pr, struct caffe_layer *pl)
+{
+    int field, wire;
+
+    pl->num_output = 0;
+    pl->bias_term = true;
+    pl->kernel = 0;
+    pl->stride = 1;
+    pl->pad = 0;
+    pl->pool = 0;
+    pl->global = false;
+    pl->group = 1;
+    pl->transpose = false;
+    pl->slope = 0.0f;
+    while (pb_next(pr, &field, &wire)) {
+        struct pb_reader sub;
+        switch (field) {
+        case 1:
+            pl->name = pb_string(pr);
+            break;
+        case 2:
+            pl->type = pb_string(pr);
+            break;
+        case 7:
+            sub = pb_sub(pr);
+            pl->blobs.push_back(vector<float>());
+            parse_blob(&sub, pl->blobs.back());
+            break;
+        case 106:
+            sub = pb_sub(pr);
+            parse_conv(&sub, pl);
+            break;
+        case 117:
+            sub = pb_sub(pr);
+            parse_ip(&sub, pl);
+            break;
+        case 121:
+            sub = pb_sub(pr);
+            parse_pool(&sub, pl);
+            break;
+        case 123:
+            sub = pb_sub(pr);
+            parse_relu(&sub, pl);
+            break;
+        default:
+            pb_skip(pr, wire);
+            break;
+        }
+    }
+}
+
+// Layers that only matter for training
+static bool train_only(const string &type)
+{
+    static const char *skip[] = {
+        "Data", "Input", "ImageData", "MemoryData", "HDF5Data",
+        "DummyData", "WindowData", "Accuracy", "Dropout", "Flatten",
+        "Silence", NULL
+    };
+    for (int i = 0; skip[i]; i++)
+        if (type == skip[i])
+            return true;
+    return false;
+}
+
+lenet::lenet()
+{
+    int8 = false;
+    calibrated = false;
+}
+
+// Fills in the shapes of l from the c x h x w input, conv and ip
+// layers come with out_c set
+bool lenet::add_layer(struct lenet_layer &l, int &c, int &h, int &w)
+{
+    l.in_c = c;
+    l.in_h = h;
+    l.in_w = w;
+    if (l.op != lenet_conv && l.op != lenet_ip)
+        l.out_c = c;
+    l.out_h = h;
+    l.out_w = w;
+    l.k = 0;
+    l.kp = 0;
+    l.in_max = 0.0f;
+    l.in_scale = 1.0f;
+
+    switch (l.op) {
+    case lenet_conv:
+        l.out_h = (h + 2 * l.pad - l.kernel) / l.stride + 1;
+        l.out_w = (w + 2 * l.pad - l.kernel) / l.stride + 1;
+        l.k = c * l.kernel * l.kernel;
+        break;
+    case lenet_max_pool:
+    case lenet_ave_pool:
+        // Caffe rounds up, then drops a window that starts in the pad
+        l.out_h = (h + 2 * l.pad - l.kernel + l.stride - 1) / l.stride + 1;
+        l.out_w = (w + 2 * l.pad - l.kernel + l.stride - 1) / l.stride + 1;
+        if (l.pad && (l.out_h - 1) * l.stride >= h + l.pad)
+            l.out_h--;
+        if (l.pad && (l.out_w - 1) * l.stride >= w + l.pad)
+            l.out_w--;
+        break;
+    case lenet_ip:
+        l.out_h = 1;
+        l.out_w = 1;
+        l.k = c * h * w;
+        break;
+    default:
+        break;
+    }
+    if (l.out_h <= 0 || l.out_w <= 0) {
+        printf("lenet: %s doesn't fit a %dx%d input\n", l.name.c_str(), h, w);
+        return false;
+    }
+    c = l.out_c;
+    h = l.out_h;
+    w = l.out_w;
+    return true;
+}
+
+/*
+ * Reads the net out of a .caffemodel for h x w single channel input.
+ * Only what LeNet uses is supported: convolution, max and average
+ * pooling, inner product, relu and softmax.
+ */
+bool lenet::load(const char *caffemodel, int h, int w)
+{
+    int fd = open(caffemodel, O_RDONLY);
+    if (fd < 0) {
+        printf("lenet: can't open %s\n", caffemodel);
+        return false;
+    }
+    struct stat st;
+    fstat(fd, &st);
+    void *pmap = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (pmap == MAP_FAILED) {
+        printf("lenet: can't map %s\n", caffemodel);
+        return false;
+    }
+
+    vector<struct caffe_layer> cls;
+    struct pb_reader net;
+    int field, wire;
+    net.p = (const uint8_t *)pmap;
+    net.end = net.p + st.st_size;
+    net.ok = true;
+    while (pb_next(&net, &field, &wire)) {
+        if (field == 2 && wire == pb_bytes) {
+            printf("lenet: %s uses V1 layers, run upgrade_net_proto_binary\n",
+                   caffemodel);
+            net.ok = false;
+            break;
+        }
+        if (field == 100 && wire == pb_bytes) {
+            struct pb_reader sub = pb_sub(&net);
+            cls.push_back(caffe_layer());
+            parse_layer(&sub, &cls.back());
+            if (!sub.ok)
+                net.ok = false;
+        } else {
+            pb_skip(&net, wire);
+        }
+    }
+    munmap(pmap, st.st_size);
+    if (!net.ok) {
+        printf("lenet: %s is corrupt\n", caffemodel);
+        return false;
+    }
+
+    int c = 1;
+    layers.clear();
+    for (size_t i = 0; i < cls.size(); i++) {
+        struct caffe_layer *pcl = &cls[i];
+        struct lenet_layer l;
+
+        if (train_only(pcl->type))
+            continue;
+        l.name = pcl->name;
+        l.kernel = pcl->kernel;
+        l.stride = pcl->stride;
+        l.pad = pcl->pad;
+        l.bias_term = pcl->bias_term;
+        l.slope = pcl->slope;
+        l.out_c = pcl->num_output;
+        if (pcl->type == "Convolution" && pcl->group == 1) {
+            l.op = lenet_conv;
+        } else if (pcl->type == "Pooling" && pcl->pool < 2) {
+            l.op = pcl->pool == 0 ? lenet_max_pool : lenet_ave_pool;
+            if (pcl->global) {
+                l.kernel = h;
+                l.stride = 1;
+                l.pad = 0;
+                if (h != w)
+                    l.kernel = 0;
+            }
+        } else if (pcl->type == "InnerProduct" && !pcl->transpose) {
+            l.op = lenet_ip;
+        } else if (pcl->type == "ReLU") {
+            l.op = lenet_relu;
+        } else if (pcl->type == "Softmax" || pcl->type == "SoftmaxWithLoss") {
+            l.op = lenet_softmax;
+        } else {
+            printf("lenet: can't run %s, a %s layer\n",
+                   pcl->name.c_str(), pcl->type.c_str());
+            return false;
+        }
+        if ((l.op == lenet_conv || l.op == lenet_max_pool ||
+             l.op == lenet_ave_pool) && (l.kernel <= 0 || l.stride <= 0)) {
+            printf("lenet: %s has no square kernel\n", l.name.c_str());
+            return false;
+        }
+
+        if (!add_layer(l, c, h, w))
+            return false;
+
+        // Weights go in rows padded out for the dot products
+        if (l.op == lenet_conv || l.op == lenet_ip) {
+            size_t nb = l.bias_term ? 2 : 1;
+            if (pcl->blobs.size() != nb ||
+                pcl->blobs[0].size() != (size_t)l.out_c * l.k ||
+                (l.bias_term && pcl->blobs[1].size() != (size_t)l.out_c)) {
+                printf("lenet: %s weights are the wrong size\n",
+                       l.name.c_str());
+                return false;
+            }
+            l.kp = (l.k + LENET_K_ALIGN - 1) / LENET_K_ALIGN * LENET_K_ALIGN;
+            l.weights.assign((size_t)l.out_c * l.kp, 0.0f);
+            for (int o = 0; o < l.out_c; o++)
+                memcpy(&l.weights[(size_t)o * l.kp],
+                       &pcl->blobs[0][(size_t)o * l.k], l.k * sizeof(float));
+            if (l.bias_term)
+                l.bias = pcl->blobs[1];
+            else
+                l.bias.assign(l.out_c, 0.0f);
+        }
+        layers.push_back(l);
+    }
+    if (layers.empty() || layers.back().op != lenet_softmax) {
+        printf("lenet: %s doesn't end in a softmax\n", caffemodel);
+        return false;
+    }
+
+    // Scratch sized for the biggest layer
+    size_t amax = 0;
+    size_t cmax = 0;
+    for (size_t i = 0; i < layers.size(); i++) {
+        struct lenet_layer *pl = &layers[i];
+        amax = std::max(amax, (size_t)pl->in_c * pl->in_h * pl->in_w);
+        amax = std::max(amax, (size_t)pl->out_c * pl->out_h * pl->out_w);
+        cmax = std::max(cmax, (size_t)pl->out_h * pl->out_w * pl->kp);
+    }
+    act[0].assign(amax, 0.0f);
+    act[1].assign(amax, 0.0f);
+    cols.assign(cmax, 0.0f);
+    qin.assign(cmax, 0);
+    calibrated = false;
+    printf("lenet: %d layers from %s, %d outputs\n",
+           (int)layers.size(), caffemodel, outputs());
+    return true;
+}
+
+int lenet::outputs()
+{
+    return layers.empty() ? 0 : layers.back().out_c;
+}
+
+static inline float hsum(v4sf v)
+{
+    float f[4];
+    memcpy(f, &v, sizeof(f));
+    return (f[0] + f[1]) + (f[2] + f[3]);
+}
+
+// Four weight rows against one input row, the input is loaded once
+static inline void dot4_float(const float *w, const float *x, int kp,
+                              float *sums)
+{
+    v4sf s0 = {0.0f, 0.0f, 0.0f, 0.0f};
+    v4sf s1 = s0;
+    v4sf s2 = s0;
+    v4sf s3 = s0;
+
+    for (int i = 0; i < kp; i += 4) {
+        v4sf vx, w0, w1, w2, w3;
+        memcpy(&vx, x + i, sizeof(vx));
+        memcpy(&w0, w + i, sizeof(w0));
+        memcpy(&w1, w + kp + i, sizeof(w1));
+        memcpy(&w2, w + 2 * kp + i, sizeof(w2));
+        memcpy(&w3, w + 3 * kp + i, sizeof(w3));
+        s0 += w0 * vx;
+        s1 += w1 * vx;
+        s2 += w2 * vx;
+        s3 += w3 * vx;
+    }
+    sums[0] = hsum(s0);
+    sums[1] = hsum(s1);
+    sums[2] = hsum(s2);
+    sums[3] = hsum(s3);
+}
+
+static inline float dot_float(const float *w, const float *x, int kp)
+{
+    v4sf s0 = {0.0f, 0.0f, 0.0f, 0.0f};
+    v4sf s1 = s0;
+
+    for (int i = 0; i < kp; i += 8) {
+        v4sf w0, w1, x0, x1;
+        memcpy(&w0, w + i, sizeof(w0));
+        memcpy(&w1, w + i + 4, sizeof(w1));
+        memcpy(&x0, x + i, sizeof(x0));
+        memcpy(&x1, x + i + 4, sizeof(x1));
+        s0 += w0 * x0;
+        s1 += w1 * x1;
+    }
+    return hsum(s0 + s1);
+}
+
+// 8 products a lane pair at a time into 32 bit sums
+static inline int32_t dot_int(const int16_t *a, const int16_t *b, int kp)
+{
+#if defined(__SSE2__)
+    __m128i s = _mm_setzero_si128();
+    for (int i = 0; i < kp; i += 8) {
+        __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+        s = _mm_add_epi32(s, _mm_madd_epi16(va, vb));
+    }
+    int32_t f[4];
+    _mm_storeu_si128((__m128i *)f, s);
+    return f[0] + f[1] + f[2] + f[3];
+#elif defined(__ARM_NEON__) || defined(__aarch64__)
+    int32x4_t s = vdupq_n_s32(0);
+    for (int i = 0; i < kp; i += 8) {
+        int16x8_t va = vld1q_s16(a + i);
+        int16x8_t vb = vld1q_s16(b + i);
+        s = vmlal_s16(s, vget_low_s16(va), vget_low_s16(vb));
+        s = vmlal_s16(s, vget_high_s16(va), vget_high_s16(vb));
+    }
+    return vgetq_lane_s32(s, 0) + vgetq_lane_s32(s, 1) +
+           vgetq_lane_s32(s, 2) + vgetq_lane_s32(s, 3);
+#else
+    int32_t s = 0;
+    for (int i = 0; i < kp; i++)
+        s += a[i] * b[i];
+    return s;
+#endif
+}
+
+// Four weight rows against one input row, like dot4_float
+static inline void dot4_int(const int16_t *w, const int16_t *x, int kp,
+                            int32_t *sums)
+{
+#if defined(__SSE2__)
+    __m128i s0 = _mm_setzero_si128();
+    __m128i s1 = s0;
+    __m128i s2 = s0;
+    __m128i s3 = s0;
+    for (int i = 0; i < kp; i += 8) {
+        __m128i vx = _mm_loadu_si128((const __m128i *)(x + i));
+        s0 = _mm_add_epi32(s0, _mm_madd_epi16(vx,
+                 _mm_loadu_si128((const __m128i *)(w + i))));
+        s1 = _mm_add_epi32(s1, _mm_madd_epi16(vx,
+                 _mm_loadu_si128((const __m128i *)(w + kp + i))));
+        s2 = _mm_add_epi32(s2, _mm_madd_epi16(vx,
+                 _mm_loadu_si128((const __m128i *)(w + 2 * kp + i))));
+        s3 = _mm_add_epi32(s3, _mm_madd_epi16(vx,
+                 _mm_loadu_si128((const __m128i *)(w + 3 * kp + i))));
+    }
+    // Transpose and add so lane j holds sum j
+    __m128i t0 = _mm_unpacklo_epi32(s0, s1);
+    __m128i t1 = _mm_unpackhi_epi32(s0, s1);
+    __m128i t2 = _mm_unpacklo_epi32(s2, s3);
+    __m128i t3 = _mm_unpackhi_epi32(s2, s3);
+    __m128i a = _mm_add_epi32(t0, t1);
+    __m128i b = _mm_add_epi32(t2, t3);
+    __m128i r = _mm_add_epi32(_mm_unpacklo_epi64(a, b),
+                              _mm_unpackhi_epi64(a, b));
+    _mm_storeu_si128((__m128i *)sums, r);
+#else
+    for (int j = 0; j < 4; j++)
+        sums[j] = dot_int(w + j * kp, x, kp);
+#endif
+}
+
+static inline int16_t quant(float x, float inv_scale)
+{
+    float q = x * inv_scale;
+    if (q > 127.0f)
+        q = 127.0f;
+    if (q < -127.0f)
+        q = -127.0f;
+    return (int16_t)(q >= 0.0f ? q + 0.5f : q - 0.5f);
+}
+
+// out[o * ostride + r] = bias[o] + weights row o . rows row r
+void lenet::dots(struct lenet_layer *pl, const float *rows, int nrows,
+                 float *out, int ostride)
+{
+    int kp = pl->kp;
+    int o = 0;
+
+    if (!(int8 && calibrated)) {
+        for (; o + 4 <= pl->out_c; o += 4) {
+            const float *pw = &pl->weights[(size_t)o * kp];
+            for (int r = 0; r < nrows; r++) {
+                float sums[4];
+                dot4_float(pw, rows + (size_t)r * kp, kp, sums);
+                for (int j = 0; j < 4; j++)
+                    out[(o + j) * ostride + r] = pl->bias[o + j] + sums[j];
+            }
+        }
+        for (; o < pl->out_c; o++) {
+            const float *pw = &pl->weights[(size_t)o * kp];
+            for (int r = 0; r < nrows; r++)
+                out[o * ostride + r] = pl->bias[o] +
+                                       dot_float(pw, rows + (size_t)r * kp, kp);
+        }
+        return;
+    }
+
+    float inv = 1.0f / pl->in_scale;
+    for (int i = 0; i < nrows * kp; i++)
+        qin[i] = quant(rows[i], inv);
+    for (; o + 4 <= pl->out_c; o += 4) {
+        const int16_t *pw = &pl->qweights[(size_t)o * kp];
+        for (int r = 0; r < nrows; r++) {
+            int32_t sums[4];
+            dot4_int(pw, &qin[(size_t)r * kp], kp, sums);
+            for (int j = 0; j < 4; j++)
+                out[(o + j) * ostride + r] = pl->bias[o + j] +
+                    pl->in_scale * pl->wscale[o + j] * sums[j];
+        }
+    }
+    for (; o < pl->out_c; o++) {
+        const int16_t *pw = &pl->qweights[(size_t)o * kp];
+        float s = pl->in_scale * pl->wscale[o];
+        for (int r = 0; r < nrows; r++)
+            out[o * ostride + r] = pl->bias[o] +
+                                   s * dot_int(pw, &qin[(size_t)r * kp], kp);
+    }
+}
+
+// im2col, then one dot product per output channel and position
+void lenet::conv(struct lenet_layer *pl, const float *in, float *out)
+{
+    int npos = pl->out_h * pl->out_w;
+    int kk = pl->kernel;
+
+    for (int oy = 0; oy < pl->out_h; oy++) {
+        for (int ox = 0; ox < pl->out_w; ox++) {
+            float *prow = &cols[(size_t)(oy * pl->out_w + ox) * pl->kp];
+            int i = 0;
+            int y0 = oy * pl->stride - pl->pad;
+            int x0 = ox * pl->stride - pl->pad;
+            bool inside = y0 >= 0 && x0 >= 0 && y0 + kk <= pl->in_h &&
+                          x0 + kk <= pl->in_w;
+            for (int c = 0; c < pl->in_c && inside; c++) {
+                const float *pin = in + (size_t)c * pl->in_h * pl->in_w +
+                                   y0 * pl->in_w + x0;
+                for (int ky = 0; ky < kk; ky++, i += kk)
+                    memcpy(prow + i, pin + ky * pl->in_w, kk * sizeof(float));
+            }
+            for (int c = 0; c < pl->in_c && !inside; c++) {
+                const float *pin = in + (size_t)c * pl->in_h * pl->in_w;
+                for (int ky = 0; ky < kk; ky++) {
+                    int y = oy * pl->stride - pl->pad + ky;
+                    for (int kx = 0; kx < kk; kx++) {
+                        int x = ox * pl->stride - pl->pad + kx;
+                        bool inside = (unsigned)y < (unsigned)pl->in_h &&
+                                      (unsigned)x < (unsigned)pl->in_w;
+                        prow[i++] = inside ? pin[y * pl->in_w + x] : 0.0f;
+                    }
+                }
+            }
+            for (; i < pl->kp; i++)
+                prow[i] = 0.0f;
+        }
+    }
+    dots(pl, &cols[0], npos, out, npos);
+}
+
+static inline v4sf max4(v4sf a, v4sf b)
+{
+    v4si m = (v4si)(a > b);
+    return (v4sf)(((v4si)a & m) | ((v4si)b & ~m));
+}
+
+void lenet::pool(struct lenet_layer *pl, const float *in, float *out)
+{
+    int kk = pl->kernel;
+    int s = pl->stride;
+
+    for (int c = 0; c < pl->in_c; c++) {
+        const float *pin = in + (size_t)c * pl->in_h * pl->in_w;
+        float *pout = out + (size_t)c * pl->out_h * pl->out_w;
+
+        // LeNet's 2x2 max pool, the row pairs 4 at a time
+        if (pl->op == lenet_max_pool && kk == 2 && s == 2 && pl->pad == 0 &&
+            pl->out_h * 2 == pl->in_h && pl->out_w * 2 == pl->in_w) {
+            float vmax[pl->in_w];
+            for (int oy = 0; oy < pl->out_h; oy++) {
+                const float *p0 = pin + 2 * oy * pl->in_w;
+                const float *p1 = p0 + pl->in_w;
+                int x = 0;
+                for (; x + 4 <= pl->in_w; x += 4) {
+                    v4sf a, b;
+                    memcpy(&a, p0 + x, sizeof(a));
+                    memcpy(&b, p1 + x, sizeof(b));
+                    a = max4(a, b);
+                    memcpy(vmax + x, &a, sizeof(a));
+                }
+                for (; x < pl->in_w; x++)
+                    vmax[x] = std::max(p0[x], p1[x]);
+                for (int ox = 0; ox < pl->out_w; ox++)
+                    pout[oy * pl->out_w + ox] = std::max(vmax[2 * ox],
+                                                         vmax[2 * ox + 1]);
+            }
+            continue;
+        }
+
+        // Caffe's windows, clipped to the input
+        for (int oy = 0; oy < pl->out_h; oy++) {
+            for (int ox = 0; ox < pl->out_w; ox++) {
+                int y0 = oy * s - pl->pad;
+                int x0 = ox * s - pl->pad;
+                int y1 = std::min(y0 + kk, pl->in_h + pl->pad);
+                int x1 = std::min(x0 + kk, pl->in_w + pl->pad);
+                int area = (y1 - y0) * (x1 - x0);
+                y0 = std::max(y0, 0);
+                x0 = std::max(x0, 0);
+                y1 = std::min(y1, pl->in_h);
+                x1 = std::min(x1, pl->in_w);
+                float v = pl->op == lenet_max_pool ? -HUGE_VALF : 0.0f;
+                for (int y = y0; y < y1; y++) {
+                    for (int x = x0; x < x1; x++) {
+                        if (pl->op == lenet_max_pool)
+                            v = std::max(v, pin[y * pl->in_w + x]);
+                        else
+                            v += pin[y * pl->in_w + x];
+                    }
+                }
+                if (pl->op == lenet_ave_pool)
+                    v /= area;
+                pout[oy * pl->out_w + ox] = v;
+            }
+        }
+    }
+}
+
+void lenet::ip(struct lenet_layer *pl, const float *in, float *out)
+{
+    memcpy(&cols[0], in, pl->k * sizeof(float));
+    for (int i = pl->k; i < pl->kp; i++)
+        cols[i] = 0.0f;
+    dots(pl, &cols[0], 1, out, 1);
+}
+
+// One image through the net. track keeps the input ranges for int8.
+const float *lenet::run(const float *in, bool track)
+{
+    const float *pin = in;
+    int cur = 0;
+
+    for (size_t i = 0; i < layers.size(); i++) {
+        struct lenet_layer *pl = &layers[i];
+        int n = pl->in_c * pl->in_h * pl->in_w;
+        float *pout = &act[cur][0];
+
+        if (track && (pl->op == lenet_conv || pl->op == lenet_ip))
+            for (int j = 0; j < n; j++)
+                pl->in_max = std::max(pl->in_max, fabsf(pin[j]));
+
+        switch (pl->op) {
+        case lenet_conv:
+            conv(pl, pin, pout);
+            break;
+        case lenet_max_pool:
+        case lenet_ave_pool:
+            pool(pl, pin, pout);
+            break;
+        case lenet_ip:
+            ip(pl, pin, pout);
+            break;
+        case lenet_relu:
+            for (int j = 0; j < n; j++)
+                pout[j] = pin[j] > 0.0f ? pin[j] : pin[j] * pl->slope;
+            break;
+        case lenet_softmax: {
+            // Over the channels at each position
+            int npos = pl->in_h * pl->in_w;
+            for (int p = 0; p < npos; p++) {
+                float m = -HUGE_VALF;
+                for (int c = 0; c < pl->in_c; c++)
+                    m = std::max(m, pin[c * npos + p]);
+                float sum = 0.0f;
+                for (int c = 0; c < pl->in_c; c++) {
+                    pout[c * npos + p] = expf(pin[c * npos + p] - m);
+                    sum += pout[c * npos + p];
+                }
+                for (int c = 0; c < pl->in_c; c++)
+                    pout[c * npos + p] /= sum;
+            }
+            break;
+        }
+        }
+        pin = pout;
+        cur ^= 1;
+    }
+    return pin;
+}
+
+// num images of in_h x in_w, nout scores for each
+void lenet::forward(const float *in, int num, float *out, int nout)
+{
+    int isize = layers[0].in_h * layers[0].in_w;
+    int n = std::min(nout, outputs());
+
+    for (int i = 0; i < num; i++) {
+        const float *pres = run(in + (size_t)i * isize, false);
+        memcpy(out + (size_t)i * nout, pres, n * sizeof(float));
+        for (int j = n; j < nout; j++)
+            out[(size_t)i * nout + j] = 0.0f;
+    }
+}
+
+// Symmetric, the input of each layer over its biggest value and the
+// weights per output channel
+void lenet::quantize()
+{
+    for (size_t i = 0; i < layers.size(); i++) {
+        struct lenet_layer *pl = &layers[i];
+        if (pl->op != lenet_conv && pl->op != lenet_ip)
+            continue;
+        pl->in_scale = pl->in_max > 0.0f ? pl->in_max / 127.0f : 1.0f;
+        pl->qweights.assign(pl->weights.size(), 0);
+        pl->wscale.assign(pl->out_c, 1.0f);
+        for (int o = 0; o < pl->out_c; o++) {
+            const float *pw = &pl->weights[(size_t)o * pl->kp];
+            float m = 0.0f;
+            for (int j = 0; j < pl->k; j++)
+                m = std::max(m, fabsf(pw[j]));
+            if (m > 0.0f)
+                pl->wscale[o] = m / 127.0f;
+            for (int j = 0; j < pl->k; j++)
+                pl->qweights[(size_t)o * pl->kp + j] =
+                    quant(pw[j], 1.0f / pl->wscale[o]);
+        }
+    }
+    calibrated = true;
+}
+
+// Runs num images through in float to find the input ranges
+void lenet::calibrate(const float *in, int num)
+{
+    int isize = layers[0].in_h * layers[0].in_w;
+    bool was_int8 = int8;
+
+    int8 = false;
+    for (size_t i = 0; i < layers.size(); i++)
+        layers[i].in_max = 0.0f;
+    for (int i = 0; i < num; i++)
+        run(in + (size_t)i * isize, true);
+    int8 = was_int8;
+    quantize();
+}
+
+// One line per conv and ip layer: <name> <biggest input>
+bool lenet::save_calibration(const char *path)
+{
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        printf("lenet: can't write %s\n", path);
+        return false;
+    }
+    for (size_t i = 0; i < layers.size(); i++)
+        if (layers[i].op == lenet_conv || layers[i].op == lenet_ip)
+            fprintf(fp, "%s %.9g\n", layers[i].name.c_str(),
+                    layers[i].in_max);
+    fclose(fp);
+    return true;
+}
+
+bool lenet::load_calibration(const char *path)
+{
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        printf("lenet: no calibration in %s\n", path);
+        return false;
+    }
+    char name[256];
+    float m;
+    int found = 0;
+    int needed = 0;
+    while (fscanf(fp, "%255s %f", name, &m) == 2) {
+        for (size_t i = 0; i < layers.size(); i++) {
+            if (layers[i].name == name) {
+                layers[i].in_max = m;
+                found++;
+            }
+        }
+    }
+    fclose(fp);
+    for (size_t i = 0; i < layers.size(); i++)
+        if (layers[i].op == lenet_conv || layers[i].op == lenet_ip)
+            needed++;
+    if (found != needed) {
+        printf("lenet: %s has %d of %d layers\n", path, found, needed);
+        return false;
+    }
+    quantize();
+    return true;
+}
@@ -0,0 +1,88 @@
+/* 
+ * Copyright 2016 Robert Bond
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+/*
+ * Runs the small LeNet that tells ants, the laser and background
+ * apart, on the cpu and without Caffe. The net and its weights come
+ * straight out of the .caffemodel. That is the training net, so its
+ * data and accuracy layers are dropped and the loss becomes a plain
+ * softmax, which is what the deploy net runs. Input is 1 x h x w
+ * floats, the raw 0 - 255 pixels like Classifier gets.
+ */
+
+enum lenet_op {
+    lenet_conv,
+    lenet_max_pool,
+    lenet_ave_pool,
+    lenet_ip,
+    lenet_relu,
+    lenet_softmax,
+};
+
+// Dot products are padded to a multiple of this with zeros
+#define LENET_K_ALIGN 8
+
+struct lenet_layer {
+    std::string name;
+    enum lenet_op op;
+    int kernel;
+    int stride;
+    int pad;
+    bool bias_term;
+    float slope;                    // Leaky relu
+    int in_c;                       // Shapes, per image
+    int in_h;
+    int in_w;
+    int out_c;
+    int out_h;
+    int out_w;
+    int k;                          // Dot product length, in_c * kernel^2
+    int kp;                         // k padded to LENET_K_ALIGN
+    std::vector<float> weights;     // out_c rows of kp
+    std::vector<float> bias;
+    // int8, weights are -127 to 127 kept in int16_t for the multiply
+    float in_max;                   // Biggest input seen calibrating
+    float in_scale;
+    std::vector<int16_t> qweights;
+    std::vector<float> wscale;      // Per output channel
+};
+
+class lenet {
+    public:
+        lenet();
+        bool load(const char *caffemodel, int h, int w);
+        void forward(const float *in, int num, float *out, int nout);
+        void calibrate(const float *in, int num);
+        bool save_calibration(const char *path);
+        bool load_calibration(const char *path);
+        int outputs();
+        bool int8;                  // Quantized path, once calibrated
+    private:
+        std::vector<struct lenet_layer> layers;
+        std::vector<float> act[2];  // Ping pong activations
+        std::vector<float> cols;    // im2col rows for one image
+        std::vector<int16_t> qin;   // Quantized input of a layer
+        bool calibrated;
+
+        bool add_layer(struct lenet_layer &l, int &c, int &h, int &w);
+        void quantize();
+        const float *run(const float *in, bool track);
+        void conv(struct lenet_layer *pl, const float *in, float *out);
+        void pool(struct lenet_layer *pl, const float *in, float *out);
+        void ip(struct lenet_layer *pl, const float *in, float *out);
+        void dots(struct lenet_layer *pl, const float *rows, int nrows,
+                  float *out, int ostride);
+};
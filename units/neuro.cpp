@@ -37,21 +37,27 @@
 #include <opencv2/highgui/highgui.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
 
+#ifndef NO_CAFFE
 #include <caffe/caffe.hpp>
+#endif
 
 
 using namespace std;
 using namespace cv;
+#ifndef NO_CAFFE
 using namespace caffe;  // NOLINT(build/namespaces)
+#endif
 using std::string;
 
+#include "hw.h"
+#include "blobs.h"
 #include "neuro.h"
+#include "pool.h"
+#include "lenet.h"
 
 extern int frame_index;
 extern bool verbose;
 
-#define IMG_SIZE 28
-
 snapshots::snapshots(Mat *pframe)
 {
     this->pframe = pframe;
@@ -108,12 +114,14 @@ void snapshots::make_snapshot(Point p, string tag)
     }   
 }
 
+#ifndef NO_CAFFE
 // See Caffe, examples/cpp_classification/classification.cpp
 
 class Classifier {
     public:
         Classifier(const string& model_file, const string& trained_file);
-        std::vector<float> Classify(const cv::Mat& img);
+        void Classify(const std::vector<cv::Mat> &imgs, float *const *outs,
+                      int n);
 
     private:
         shared_ptr<Net<float> > net_;
@@ -140,61 +148,163 @@ Classifier::Classifier(const string& model_file,
     CHECK(input_geometry_ == cv::Size(IMG_SIZE, IMG_SIZE)) << "Input layer height, width wrong";
 }
 
-std::vector<float> Classifier::Classify(const cv::Mat& img)
+// One forward pass for all of imgs, n scores for each into outs[i]
+void Classifier::Classify(const std::vector<cv::Mat> &imgs,
+                          float *const *outs, int n)
 {
+    int num = imgs.size();
+    int plane = input_geometry_.height * input_geometry_.width;
     Blob<float>* input_layer = net_->input_blobs()[0];
-    input_layer->Reshape(1, num_channels_,
-                         input_geometry_.height, input_geometry_.width);
-    /* Forward dimension change to all layers. */
-    net_->Reshape();
+
+    /* Forward dimension change to all layers, only when it changes. */
+    if (input_layer->num() != num) {
+        input_layer->Reshape(num, num_channels_,
+                             input_geometry_.height, input_geometry_.width);
+        net_->Reshape();
+    }
 
     /*
-     * Map dest Matrix data directly to input layer
+     * Map a dest Matrix onto each image's plane of the input layer
      * so that converTo fills it.
      */
     float* input_data = input_layer->mutable_cpu_data();
-    cv::Mat dest(IMG_SIZE, IMG_SIZE, CV_32FC1, input_data);
-    img.convertTo(dest, CV_32FC1, 1, 0);
+    for (int i = 0; i < num; i++) {
+        cv::Mat dest(IMG_SIZE, IMG_SIZE, CV_32FC1, input_data + i * plane);
+        imgs[i].convertTo(dest, CV_32FC1, 1, 0);
+    }
 
     net_->ForwardPrefilled();
 
-    /* Copy the output layer to a std::vector */
+    /* Copy the output layer out */
     Blob<float>* output_layer = net_->output_blobs()[0];
     const float* begin = output_layer->cpu_data();
-    const float* end = begin + output_layer->channels();
-    return std::vector<float>(begin, end);
+    int nout = output_layer->channels();
+    n = std::min(n, nout);
+    for (int i = 0; i < num; i++)
+        std::copy(begin + i * nout, begin + i * nout + n, outs[i]);
 }
 
-image_classifier::image_classifier()
+#endif
+
+image_classifier::image_classifier(bool native, bool int8)
 {
-    ::google::InitGoogleLogging("units");
+    pclass = NULL;
+    pnet = NULL;
+#ifdef NO_CAFFE
+    native = true;
+#endif
+    if (!native) {
+#ifndef NO_CAFFE
+        ::google::InitGoogleLogging("units");
+        pclass = new Classifier(LENET_MODEL, LENET_WEIGHTS);
+#endif
+        return;
+    }
 
-    string model_file   = "/home/rgb/caffe/examples/ants/lenet_deploy.prototxt";
-    string trained_file = "/home/rgb/caffe/examples/ants/lenet_iter_20000.caffemodel";
-    pclass = new Classifier(model_file, trained_file);
+    pnet = new lenet();
+    if (!pnet->load(LENET_WEIGHTS, IMG_SIZE, IMG_SIZE)) {
+        printf("image_classifier: can't load %s\n", LENET_WEIGHTS);
+        exit(1);
+    }
+    if (int8) {
+        if (pnet->load_calibration(LENET_CALIB))
+            pnet->int8 = true;
+        else
+            printf("image_classifier: no int8 scales, running float\n");
+    }
 }
 
-std::vector<float> image_classifier::get_image_type(Mat *pframe, Point p)
+image_classifier::~image_classifier()
 {
+#ifndef NO_CAFFE
+    delete pclass;
+#endif
+    delete pnet;
+}
 
+const char *image_classifier::engine()
+{
+    if (pclass)
+        return "caffe";
+    return pnet->int8 ? "lenet int8" : "lenet";
+}
 
-    if (IMG_SIZE/2 > p.x ||
-        IMG_SIZE/2 > p.y ||
-        p.x + IMG_SIZE/2 > pframe->cols ||
-        p.y + IMG_SIZE/2 > pframe->rows) {
+// n_image_types scores for each of imgs into outs[i], in one pass
+void image_classifier::score(const std::vector<Mat> &imgs,
+                             float *const *outs)
+{
+    int num = imgs.size();
+    int plane = IMG_SIZE * IMG_SIZE;
 
-        printf("image_classifier: bad point %d %d\n", p.x, p.y);
-        return std::vector<float> (3, 0.0f);
+#ifndef NO_CAFFE
+    if (pclass) {
+        pclass->Classify(imgs, outs, n_image_types);
+        return;
     }
+#endif
+    input.resize((size_t)num * plane);
+    output.resize((size_t)num * n_image_types);
+    for (int i = 0; i < num; i++) {
+        Mat dest(IMG_SIZE, IMG_SIZE, CV_32FC1, &input[(size_t)i * plane]);
+        imgs[i].convertTo(dest, CV_32FC1, 1, 0);
+    }
+    pnet->forward(&input[0], num, &output[0], n_image_types);
+    for (int i = 0; i < num; i++)
+        std::copy(&output[(size_t)i * n_image_types],
+                  &output[(size_t)i * n_image_types] + n_image_types, outs[i]);
+}
 
-    Rect src_roi(p.x - IMG_SIZE/2, p.y - IMG_SIZE/2, IMG_SIZE, IMG_SIZE);
-    Mat img(*pframe, src_roi);
+/*
+ * Scores every blob that isn't rejected, with as few forward passes as
+ * there are batches of class_max_batch. Each blob's image_type gets
+ * one score per image_type, in frame_mem until the end of the frame.
+ * Blobs too close to the edge for a patch score 0. Blobs that already
+ * have scores, from their ant's cache, are left alone.
+ */
+void image_classifier::classify(Mat *pframe, struct rec_list *precs)
+{
+    patches.clear();
+    scores.clear();
+    for (struct rec_list *pn = precs; pn; pn = pn->pnext) {
+        if (pn->kind == blob_neither || pn->image_type)
+            continue;
+        float *retv = (float *)frame_mem.alloc(n_image_types * sizeof(float));
+        std::fill(retv, retv + n_image_types, 0.0f);
+        pn->image_type = retv;
+
+        Point p(pn->xc, pn->yc);
+        if (IMG_SIZE/2 > p.x ||
+            IMG_SIZE/2 > p.y ||
+            p.x + IMG_SIZE/2 > pframe->cols ||
+            p.y + IMG_SIZE/2 > pframe->rows) {
+
+            printf("image_classifier: bad point %d %d\n", p.x, p.y);
+            continue;
+        }
+
+        Rect src_roi(p.x - IMG_SIZE/2, p.y - IMG_SIZE/2, IMG_SIZE, IMG_SIZE);
+        patches.push_back(Mat(*pframe, src_roi));
+        scores.push_back(retv);
+        if ((int)patches.size() == class_max_batch)
+            run_batch();
+    }
+    run_batch();
+}
 
-    std::vector<float> retv = pclass->Classify(img);
+void image_classifier::run_batch()
+{
+    if (patches.empty())
+        return;
 
-    if (verbose)
-        printf("image_classifier: ant %5.3f, laser %5.3f, bg %5.3f\n",
-               retv[ant_index], retv[laser_index], retv[bg_index]);
+    score(patches, &scores[0]);
 
-    return retv;
+    if (verbose) {
+        printf("image_classifier: %d patches\n", (int)patches.size());
+        for (size_t i = 0; i < scores.size(); i++)
+            printf("image_classifier: ant %5.3f, laser %5.3f, bg %5.3f\n",
+                   scores[i][ant_index], scores[i][laser_index],
+                   scores[i][bg_index]);
+    }
+    patches.clear();
+    scores.clear();
 }
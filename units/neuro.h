@@ -44,14 +44,41 @@ enum image_type {
     bg_index = 0,
     ant_index,
     laser_index,
+    n_image_types
 };
 
 class Classifier;
+class lenet;
+struct rec_list;
 
+#define IMG_SIZE 28                     // Patches are IMG_SIZE square
+
+// Most patches in one forward pass, more go in more passes
+const int class_max_batch = 256;
+
+#define LENET_MODEL "/home/rgb/caffe/examples/ants/lenet_deploy.prototxt"
+#define LENET_WEIGHTS "/home/rgb/caffe/examples/ants/lenet_iter_20000.caffemodel"
+// int8 scales for the built in engine, bench makes it from images/
+#define LENET_CALIB "/home/rgb/lenet.calib"
+
+/*
+ * Scores patches with Caffe or with the built in lenet engine (native).
+ * The built in one runs int8 if asked and LENET_CALIB is there. Without
+ * Caffe (NO_CAFFE) it is always native.
+ */
 class image_classifier {
     public:
-        image_classifier(void);
-        std::vector<float> get_image_type(Mat *pframe, Point p);
+        image_classifier(bool native = false, bool int8 = false);
+        ~image_classifier();
+        void classify(Mat *pframe, struct rec_list *precs);
+        void score(const std::vector<Mat> &imgs, float *const *outs);
+        const char *engine();
     private:
         Classifier *pclass;
+        lenet *pnet;
+        std::vector<float> input;   // Patches as floats for pnet
+        std::vector<float> output;
+        std::vector<Mat> patches;
+        std::vector<float *> scores;
+        void run_batch();
 };
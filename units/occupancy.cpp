@@ -0,0 +1,141 @@
+/* 
+ * Copyright 2016 Robert Bond
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <iostream>
+#include <sys/time.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <math.h>
+#include <assert.h>
+
+#include "opencv2/core/core.hpp"
+
+using namespace std;
+using namespace cv;
+
+#include "occupancy.h"
+
+void occ_setup(struct fg_occupancy *po, int rows, int cols)
+{
+    po->tiles_x = (cols + OCC_TILE - 1) / OCC_TILE;
+    po->tiles_y = (rows + OCC_TILE - 1) / OCC_TILE;
+    assert(po->tiles_x <= 64);
+    po->count = new uint16_t[po->tiles_x * po->tiles_y];
+    po->bits = new uint64_t[po->tiles_y];
+    occ_clear(po);
+    occ_finish(po);
+}
+
+void occ_clear(struct fg_occupancy *po)
+{
+    memset(po->count, 0, po->tiles_x * po->tiles_y * sizeof(po->count[0]));
+}
+
+// Count of the nonzero bytes in w
+static inline int nonzero_bytes(uint64_t w)
+{
+    const uint64_t low7 = 0x7f7f7f7f7f7f7f7fULL;
+    uint64_t t = (w & low7) + low7;
+    t = ~(t | w | low7);
+    return 8 - __builtin_popcountll(t);
+}
+
+// Recounts every tile that overlaps r from the fg mask
+void occ_count(struct fg_occupancy *po, Mat &fg, Rect r)
+{
+    r &= Rect(0, 0, fg.cols, fg.rows);
+    if (r.width <= 0 || r.height <= 0)
+        return;
+    int tx0 = r.x / OCC_TILE;
+    int tx1 = (r.x + r.width - 1) / OCC_TILE;
+    int ty0 = r.y / OCC_TILE;
+    int ty1 = (r.y + r.height - 1) / OCC_TILE;
+
+    for (int ty = ty0; ty <= ty1; ty++) {
+        int ys = ty * OCC_TILE;
+        int ye = std::min(ys + OCC_TILE, fg.rows);
+        for (int tx = tx0; tx <= tx1; tx++) {
+            int xs = tx * OCC_TILE;
+            int xe = std::min(xs + OCC_TILE, fg.cols);
+            int n = 0;
+            for (int y = ys; y < ye; y++) {
+                const uint8_t *p = fg.ptr(y);
+                int x = xs;
+                for (; x + 8 <= xe; x += 8) {
+                    uint64_t w;
+                    memcpy(&w, p + x, sizeof(w));
+                    if (w)
+                        n += nonzero_bytes(w);
+                }
+                for (; x < xe; x++)
+                    n += p[x] != 0;
+            }
+            occ_tile(po, tx, ty) = n;
+        }
+    }
+}
+
+// Builds the bitmap and total from the tile counts
+void occ_finish(struct fg_occupancy *po)
+{
+    po->npix = 0;
+    for (int ty = 0; ty < po->tiles_y; ty++) {
+        uint64_t bits = 0;
+        for (int tx = 0; tx < po->tiles_x; tx++) {
+            int n = occ_tile(po, tx, ty);
+            if (n) {
+                bits |= 1ULL << tx;
+                po->npix += n;
+            }
+        }
+        po->bits[ty] = bits;
+    }
+}
+
+// Tile bitmaps laid out like po->bits, used for regions of interest
+static inline uint64_t row_mask(int tx0, int tx1)
+{
+    uint64_t hi = tx1 >= 63 ? ~0ULL : (1ULL << (tx1 + 1)) - 1;
+    return hi & ~((1ULL << tx0) - 1);
+}
+
+// Sets the bits of every tile that overlaps r
+void occ_mark(const struct fg_occupancy *po, uint64_t *bits, Rect r)
+{
+    r &= Rect(0, 0, po->tiles_x * OCC_TILE, po->tiles_y * OCC_TILE);
+    if (r.width <= 0 || r.height <= 0)
+        return;
+    uint64_t mask = row_mask(r.x / OCC_TILE, (r.x + r.width - 1) / OCC_TILE);
+    for (int ty = r.y / OCC_TILE; ty <= (r.y + r.height - 1) / OCC_TILE; ty++)
+        bits[ty] |= mask;
+}
+
+// True if any tile overlapping r is set in bits
+bool occ_any(const struct fg_occupancy *po, const uint64_t *bits, Rect r)
+{
+    r &= Rect(0, 0, po->tiles_x * OCC_TILE, po->tiles_y * OCC_TILE);
+    if (r.width <= 0 || r.height <= 0)
+        return false;
+    uint64_t mask = row_mask(r.x / OCC_TILE, (r.x + r.width - 1) / OCC_TILE);
+    for (int ty = r.y / OCC_TILE; ty <= (r.y + r.height - 1) / OCC_TILE; ty++)
+        if (bits[ty] & mask)
+            return true;
+    return false;
+}
@@ -0,0 +1,44 @@
+/* 
+ * Copyright 2016 Robert Bond
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+// Background subtraction also reports where the fg pixels are,
+// in tiles of OCC_TILE x OCC_TILE pixels.
+#define OCC_TILE 32
+
+struct fg_occupancy {
+    int tiles_x;                    // At most 64
+    int tiles_y;
+    uint32_t npix;                  // Exact count of fg pixels
+    uint16_t *count;                // fg pixels in each tile
+    uint64_t *bits;                 // Bit tx of bits[ty] set if tile has fg
+};
+
+void occ_setup(struct fg_occupancy *po, int rows, int cols);
+void occ_clear(struct fg_occupancy *po);
+void occ_count(struct fg_occupancy *po, Mat &fg, Rect r);
+void occ_finish(struct fg_occupancy *po);
+void occ_mark(const struct fg_occupancy *po, uint64_t *bits, Rect r);
+bool occ_any(const struct fg_occupancy *po, const uint64_t *bits, Rect r);
+
+inline uint16_t &occ_tile(struct fg_occupancy *po, int tx, int ty)
+{
+    return po->count[ty * po->tiles_x + tx];
+}
+
+inline bool occupied(const struct fg_occupancy *po, int tx, int ty)
+{
+    return (po->bits[ty] >> tx) & 1;
+}
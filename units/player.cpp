@@ -107,21 +107,18 @@ void interp(Mat &frame, struct rpos *pc, struct rpos *pn)
     struct pix_tbl *pix_tbl;
     int scale = xpix / frame.cols;
     int width, len;
-    if (scale == 1) {
-        pix_tbl = pix_tbl_1;
-    } else {
+    // add_ant always gets the full size frame, even with -H
+    if (scale != 1) {
         DPRINTF("player.cpp: interp: No support for scale = %d!\n", scale);
         return;
     }
-    for (int i = 0; pix_tbl[i+1].target > 0; i++) 
-        if (ideal_size >= pix_tbl[i].target &&
-            ideal_size < pix_tbl[i+1].target) {
-            len = pix_tbl[i].len;
-            width = pix_tbl[i].width;
-            break;
-        }
-    px /= scale;
-    py /= scale;
+    pix_tbl = pix_tbl_1;
+    len = pix_tbl[0].len;
+    width = pix_tbl[0].width;
+    for (int i = 0; pix_tbl[i].target > 0 && ideal_size >= pix_tbl[i].target; i++) {
+        len = pix_tbl[i].len;
+        width = pix_tbl[i].width;
+    }
     DPRINTF("Play %d %d ideal_size: %d npix: %d frame: %d\n", px, py, ideal_size, width*len, frame_index);
     for (int i = 0; i < len; i++)
         for (int j = 0; j < width; j++)
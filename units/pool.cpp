@@ -0,0 +1,263 @@
+/* 
+ * Copyright 2016 Robert Bond
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <iostream>
+#include <sys/time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <math.h>
+#include <malloc.h>
+
+#include <vector>
+
+#include "opencv2/core/core.hpp"
+#include "opencv2/gpu/gpu.hpp"
+#include "opencv2/highgui/highgui.hpp"
+
+using namespace std;
+using namespace cv;
+
+#include "pool.h"
+
+frame_pool::frame_pool()
+{
+    nmoves = 0;
+}
+
+frame_pool::~frame_pool()
+{
+    for (size_t i = 0; i < blocks.size(); i++)
+        free(blocks[i]);
+}
+
+// Points *pm at a new aligned, padded buffer owned by the pool
+void frame_pool::host(Mat *pm, int rows, int cols, int type)
+{
+    size_t step = alignSize(cols * CV_ELEM_SIZE(type), POOL_ALIGN);
+    void *p;
+
+    if (posix_memalign(&p, POOL_ALIGN, step * rows) != 0) {
+        printf("frame_pool: out of memory\n");
+        exit(1);
+    }
+    memset(p, 0, step * rows);
+    blocks.push_back(p);
+    *pm = Mat(rows, cols, type, p, step);
+    hmats.push_back(pm);
+    hdata.push_back(pm->data);
+}
+
+// Device memory comes pitched from cudaMallocPitch already
+void frame_pool::dev(gpu::GpuMat *pm, int rows, int cols, int type)
+{
+    pm->create(rows, cols, type);
+    dmats.push_back(pm);
+    ddata.push_back(pm->data);
+}
+
+// Returns how many buffers moved since the last call
+int frame_pool::moved()
+{
+    int moved = 0;
+
+    for (size_t i = 0; i < hmats.size(); i++) {
+        if (hmats[i]->data != hdata[i]) {
+            hdata[i] = hmats[i]->data;
+            moved++;
+        }
+    }
+    for (size_t i = 0; i < dmats.size(); i++) {
+        if (dmats[i]->data != ddata[i]) {
+            ddata[i] = dmats[i]->data;
+            moved++;
+        }
+    }
+    nmoves += moved;
+    return moved;
+}
+
+// Moves since the pool was set up
+uint32_t frame_pool::moves()
+{
+    return nmoves;
+}
+
+/*
+ * glibc lets a program replace malloc and friends. These count the
+ * call and hand it to glibc's own allocator, which is still what
+ * free() goes back to. The counters are only touched once armed.
+ */
+extern "C" {
+void *__libc_malloc(size_t n);
+void *__libc_calloc(size_t n, size_t size);
+void *__libc_realloc(void *p, size_t n);
+void *__libc_memalign(size_t align, size_t n);
+void __libc_free(void *p);
+}
+
+static volatile bool heap_armed = false;
+static volatile uint32_t heap_count = 0;
+static volatile uint64_t heap_total = 0;
+
+static inline void heap_note(size_t n)
+{
+    if (!heap_armed)
+        return;
+    __sync_fetch_and_add(&heap_count, 1);
+    __sync_fetch_and_add(&heap_total, (uint64_t)n);
+}
+
+extern "C" void *malloc(size_t n) throw()
+{
+    heap_note(n);
+    return __libc_malloc(n);
+}
+
+extern "C" void *calloc(size_t n, size_t size) throw()
+{
+    heap_note(n * size);
+    return __libc_calloc(n, size);
+}
+
+extern "C" void *realloc(void *p, size_t n) throw()
+{
+    heap_note(n);
+    return __libc_realloc(p, n);
+}
+
+extern "C" void *memalign(size_t align, size_t n) throw()
+{
+    heap_note(n);
+    return __libc_memalign(align, n);
+}
+
+extern "C" int posix_memalign(void **pp, size_t align, size_t n) throw()
+{
+    if (align < sizeof(void *) || (align & (align - 1)) != 0)
+        return EINVAL;
+    heap_note(n);
+    void *p = __libc_memalign(align, n);
+    if (p == NULL)
+        return ENOMEM;
+    *pp = p;
+    return 0;
+}
+
+extern "C" void *valloc(size_t n) throw()
+{
+    heap_note(n);
+    return __libc_memalign(getpagesize(), n);
+}
+
+extern "C" void free(void *p) throw()
+{
+    __libc_free(p);
+}
+
+// Start counting, call it once the main loop has settled
+void heap_watch()
+{
+    heap_armed = true;
+}
+
+uint32_t heap_allocs()
+{
+    return heap_count;
+}
+
+uint64_t heap_bytes()
+{
+    return heap_total;
+}
+
+frame_arena frame_mem;
+
+frame_arena::frame_arena(size_t size)
+{
+    this->size = size;
+    base = (char *)malloc(size);
+    off = 0;
+    extra_bytes = 0;
+    peak = 0;
+    total = 0;
+    frames = 0;
+    grows = 0;
+}
+
+frame_arena::~frame_arena()
+{
+    reset();
+    free(base);
+}
+
+void *frame_arena::alloc(size_t n)
+{
+    n = alignSize(n, ARENA_ALIGN);
+    if (off + n <= size) {
+        void *p = base + off;
+        off += n;
+        return p;
+    }
+    void *p = malloc(n);
+    if (p == NULL) {
+        printf("frame_arena: out of memory\n");
+        exit(1);
+    }
+    extra.push_back(p);
+    extra_bytes += n;
+    return p;
+}
+
+// End of a frame, everything from alloc() is gone
+void frame_arena::reset()
+{
+    size_t n = used();
+
+    total += n;
+    frames++;
+    peak = std::max(peak, n);
+    off = 0;
+    if (extra.empty())
+        return;
+
+    for (size_t i = 0; i < extra.size(); i++)
+        free(extra[i]);
+    extra.clear();
+    extra_bytes = 0;
+    free(base);
+    size = alignSize(n * 2, ARENA_SIZE);
+    base = (char *)malloc(size);
+    grows++;
+}
+
+// Bytes handed out since the last reset
+size_t frame_arena::used()
+{
+    return off + extra_bytes;
+}
+
+void frame_arena::report()
+{
+    printf("Arena: %.0lf bytes/frame, %u peak, %u size, %u grows\n",
+           frames ? (double)total / frames : 0.0, (uint32_t)peak,
+           (uint32_t)size, grows);
+}
@@ -0,0 +1,84 @@
+/* 
+ * Copyright 2016 Robert Bond
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+// Rows of host buffers start on this boundary and are padded to it
+#define POOL_ALIGN 64
+
+/*
+ * Long lived frame buffers. The pool allocates them once and then
+ * watches their data pointers. If opencv ever reallocates one, moved()
+ * counts it. Heap allocations anywhere else are counted by the
+ * heap_* calls below.
+ */
+class frame_pool {
+    public:
+        frame_pool();
+        ~frame_pool();
+        void host(Mat *pm, int rows, int cols, int type);
+        void dev(gpu::GpuMat *pm, int rows, int cols, int type);
+        int moved();
+        uint32_t moves();
+    private:
+        std::vector<Mat *> hmats;
+        std::vector<uchar *> hdata;
+        std::vector<gpu::GpuMat *> dmats;
+        std::vector<uchar *> ddata;
+        std::vector<void *> blocks;
+        uint32_t nmoves;
+};
+
+/*
+ * Every malloc, calloc, realloc and memalign in the process, from any
+ * thread, goes through a counter once heap_watch() has been called.
+ * That includes new, opencv temporaries and vector growth, so a steady
+ * state main loop should leave heap_allocs() at zero.
+ */
+void heap_watch();
+uint32_t heap_allocs();
+uint64_t heap_bytes();
+
+// Starting size of the per frame arena, it grows if a frame needs more
+#define ARENA_SIZE (64 * 1024)
+#define ARENA_ALIGN 16
+
+/*
+ * Scratch memory for one trip around the main loop: blob lists and
+ * classifier results. alloc() bumps a pointer and reset() hands it
+ * all back at once, nothing is freed one at a time. A frame that
+ * runs out gets the rest from malloc, and the next reset grows the
+ * arena to fit.
+ */
+class frame_arena {
+    public:
+        frame_arena(size_t size = ARENA_SIZE);
+        ~frame_arena();
+        void *alloc(size_t n);
+        void reset();
+        size_t used();
+        void report();
+    private:
+        char *base;
+        size_t size;
+        size_t off;
+        std::vector<void *> extra;  // Overflow from malloc
+        size_t extra_bytes;
+        size_t peak;
+        uint64_t total;
+        uint32_t frames;
+        uint32_t grows;
+};
+
+extern frame_arena frame_mem;
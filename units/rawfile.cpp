@@ -0,0 +1,266 @@
+/* 
+ * Copyright 2016 Robert Bond
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <iostream>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "opencv2/core/core.hpp"
+#include "opencv2/imgproc/imgproc.hpp"
+
+using namespace std;
+using namespace cv;
+
+#include "v4l2.h"
+#include "rawfile.h"
+
+raw_recorder::raw_recorder()
+{
+    fd = -1;
+    width = 0;
+    height = 0;
+    staged_ticks = 0;
+    have_staged = false;
+    nframes = 0;
+}
+
+// Appends to an existing container if the frame size matches
+bool raw_recorder::open(const char *path, int width, int height)
+{
+    struct raw_header hdr;
+    struct stat st;
+
+    fd = ::open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        printf("raw_recorder: can't open %s\n", path);
+        return false;
+    }
+    this->width = width;
+    this->height = height;
+
+    if (st.st_size == 0) {
+        memset(&hdr, 0, sizeof(hdr));
+        memcpy(hdr.magic, RAW_MAGIC, sizeof(hdr.magic));
+        hdr.width = width;
+        hdr.height = height;
+        hdr.tps = getTickFrequency();
+        if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+            printf("raw_recorder: can't write %s\n", path);
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+        memcmp(hdr.magic, RAW_MAGIC, sizeof(hdr.magic)) != 0 ||
+        hdr.width != width || hdr.height != height) {
+        printf("raw_recorder: %s isn't a %dx%d container\n",
+               path, width, height);
+        close();
+        return false;
+    }
+    // A torn last record would put every new one off the grid
+    size_t rec_size = raw_rec_size(width, height);
+    nframes = (st.st_size - sizeof(hdr)) / rec_size;
+    off_t end = sizeof(hdr) + (off_t)nframes * rec_size;
+    if (st.st_size != end) {
+        printf("raw_recorder: dropping a torn frame at the end of %s\n",
+               path);
+        if (ftruncate(fd, end) < 0) {
+            printf("raw_recorder: can't truncate %s\n", path);
+            close();
+            return false;
+        }
+    }
+    printf("raw_recorder: appending to %s after %u frames\n", path, nframes);
+    return true;
+}
+
+// Called before anything is drawn on the frame. Color frames are
+// stored as gray, anything else stops the recording.
+void raw_recorder::stage(const Mat &frame, uint64_t ticks)
+{
+    if (fd < 0)
+        return;
+    if (frame.rows != height || frame.cols != width ||
+        (frame.type() != CV_8UC1 && frame.type() != CV_8UC3)) {
+        printf("raw_recorder: can't record a %dx%d type %d frame, "
+               "recording stopped\n", frame.cols, frame.rows, frame.type());
+        close();
+        return;
+    }
+    staged.create(height, width, CV_8UC1);
+    if (frame.type() == CV_8UC3)
+        cvtColor(frame, staged, CV_BGR2GRAY);
+    else
+        frame.copyTo(staged);
+    staged_ticks = ticks;
+    have_staged = true;
+}
+
+void raw_recorder::append(struct raw_meta *pmeta)
+{
+    if (fd < 0 || !have_staged)
+        return;
+    have_staged = false;
+    pmeta->ticks = staged_ticks;
+    memset(pmeta->pad, 0, sizeof(pmeta->pad));
+
+    // staged is ours, so it is always continuous
+    static const uint8_t pad[RAW_ALIGN] = { 0 };
+    struct iovec iov[3];
+    ssize_t len = raw_rec_size(width, height);
+    iov[0].iov_base = pmeta;
+    iov[0].iov_len = sizeof(*pmeta);
+    iov[1].iov_base = staged.data;
+    iov[1].iov_len = width * height;
+    iov[2].iov_base = (void *)pad;
+    iov[2].iov_len = len - sizeof(*pmeta) - width * height;
+    if (writev(fd, iov, 3) != len) {
+        printf("raw_recorder: write failed, recording stopped\n");
+        close();
+        return;
+    }
+    nframes++;
+}
+
+void raw_recorder::close()
+{
+    if (fd >= 0)
+        ::close(fd);
+    fd = -1;
+}
+
+uint32_t raw_recorder::frames()
+{
+    return nframes;
+}
+
+raw_replay::raw_replay()
+{
+    fd = -1;
+    base = NULL;
+    length = 0;
+    width = 0;
+    height = 0;
+    rec_size = 0;
+    tps = 0.0;
+    nframes = 0;
+    next = 0;
+    pmeta = NULL;
+}
+
+bool raw_replay::open(const char *path)
+{
+    struct stat st;
+
+    fd = ::open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0 ||
+        (size_t)st.st_size < sizeof(struct raw_header)) {
+        printf("raw_replay: can't open %s\n", path);
+        return false;
+    }
+    length = st.st_size;
+
+    // Private so drawing on a frame never touches the file
+    base = (uint8_t *)mmap(NULL, length, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE, fd, 0);
+    if (base == MAP_FAILED) {
+        printf("raw_replay: mmap failed\n");
+        base = NULL;
+        return false;
+    }
+
+    struct raw_header *phdr = (struct raw_header *)base;
+    if (memcmp(phdr->magic, RAW_MAGIC, sizeof(phdr->magic)) != 0) {
+        printf("raw_replay: %s isn't a raw container\n", path);
+        release();
+        return false;
+    }
+    width = phdr->width;
+    height = phdr->height;
+    tps = phdr->tps;
+    if (width <= 0 || height <= 0 || width > raw_max_dim ||
+        height > raw_max_dim || !(tps > 0.0)) {
+        printf("raw_replay: %s has a bad header, %dx%d at %g ticks/s\n",
+               path, width, height, tps);
+        release();
+        return false;
+    }
+    rec_size = raw_rec_size(width, height);
+    nframes = (length - sizeof(*phdr)) / rec_size;
+    if (sizeof(*phdr) + (size_t)nframes * rec_size != length)
+        printf("raw_replay: %s ends in a torn frame, skipping it\n", path);
+    madvise(base, length, MADV_SEQUENTIAL);
+    printf("raw_replay: %s %dx%d, %u frames\n", path, width, height, nframes);
+    return true;
+}
+
+// As fast as the pipeline can take them, no frames are skipped
+bool raw_replay::grab(Mat &frame, uint64_t *pticks)
+{
+    if (next >= nframes)
+        return false;
+
+    uint8_t *prec = base + sizeof(struct raw_header) + next * rec_size;
+    pmeta = (const struct raw_meta *)prec;
+    frame = Mat(height, width, CV_8UC1, prec + sizeof(struct raw_meta));
+    // Capture time on this box's tick clock
+    if (tps == getTickFrequency())
+        *pticks = pmeta->ticks;
+    else
+        *pticks = (uint64_t)(pmeta->ticks * (getTickFrequency() / tps));
+    next++;
+    return true;
+}
+
+void raw_replay::release()
+{
+    if (base)
+        munmap(base, length);
+    if (fd >= 0)
+        ::close(fd);
+    base = NULL;
+    fd = -1;
+    pmeta = NULL;
+}
+
+uint32_t raw_replay::dropped()
+{
+    return 0;
+}
+
+uint32_t raw_replay::frames()
+{
+    return nframes;
+}
+
+Size raw_replay::size()
+{
+    return Size(width, height);
+}
+
+const struct raw_meta *raw_replay::meta()
+{
+    return pmeta;
+}
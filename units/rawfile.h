@@ -0,0 +1,99 @@
+/* 
+ * Copyright 2016 Robert Bond
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+/*
+ * Append-only raw frame container. A 64 byte header, then for each
+ * frame a 64 byte raw_meta followed by the 8 bit pixels, padded out to
+ * RAW_ALIGN. Records are all the same size so frame n is at a fixed
+ * offset, and the pixels stay RAW_ALIGN aligned in the mmap.
+ */
+
+#define RAW_MAGIC "ANTRAW2"
+#define RAW_ALIGN 64
+
+struct raw_header {
+    char magic[8];
+    int32_t width;
+    int32_t height;
+    double tps;                 // getTickFrequency() of the recorder
+    uint8_t pad[40];
+};
+
+struct raw_meta {
+    uint64_t ticks;             // Capture time
+    uint32_t index;             // frame_index
+    int32_t target_px;          // Laser target
+    int32_t target_py;
+    int32_t state;              // Main loop state after this frame,
+                                // or raw_state_idle
+    int32_t laser_on;
+    uint8_t pad[36];
+};
+
+// raw_meta state of a frame the idle gate let through untracked
+const int32_t raw_state_idle = -1;
+
+// Largest frame a container can hold
+const int raw_max_dim = 8192;
+
+inline size_t raw_rec_size(int width, int height)
+{
+    size_t n = sizeof(struct raw_meta) + (size_t)width * height;
+    return (n + RAW_ALIGN - 1) & ~(size_t)(RAW_ALIGN - 1);
+}
+
+// Records camera frames as they come in, metadata once it is known
+class raw_recorder {
+    public:
+        raw_recorder();
+        bool open(const char *path, int width, int height);
+        void stage(const Mat &frame, uint64_t ticks);
+        void append(struct raw_meta *pmeta);
+        void close();
+        uint32_t frames();
+    private:
+        int fd;
+        int width;
+        int height;
+        Mat staged;                 // Copy of the raw camera frame
+        uint64_t staged_ticks;
+        bool have_staged;
+        uint32_t nframes;
+};
+
+// Plays a container back with frames straight out of the mmap
+class raw_replay : public raw_source {
+    public:
+        raw_replay();
+        bool open(const char *path);
+        bool grab(Mat &frame, uint64_t *pticks);
+        void release();
+        uint32_t dropped();
+        uint32_t frames();
+        Size size();
+        const struct raw_meta *meta();
+    private:
+        int fd;
+        uint8_t *base;
+        size_t length;
+        int width;
+        int height;
+        size_t rec_size;
+        double tps;                 // Of the recorder
+        uint32_t nframes;
+        uint32_t next;
+        const struct raw_meta *pmeta;  // Last frame handed out
+};
@@ -0,0 +1,148 @@
+/* 
+ * Copyright 2016 Robert Bond
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#include "opencv2/core/core.hpp"
+
+using namespace std;
+using namespace cv;
+
+#include "hw.h"
+#include "spot.h"
+
+extern int frame_index;
+
+// gcc maps these onto SSE2 on x86 and NEON on arm
+typedef uint8_t v16u8 __attribute__ ((vector_size (16)));
+
+static inline v16u8 load16(const uint8_t *p)
+{
+    v16u8 v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline v16u8 splat16(uint8_t b)
+{
+    v16u8 v;
+    memset(&v, b, sizeof(v));
+    return v;
+}
+
+static inline bool any16(v16u8 v)
+{
+    uint64_t w[2];
+    memcpy(w, &v, sizeof(w));
+    return (w[0] | w[1]) != 0;
+}
+
+// Saturated pixels in the window, count and bounding box
+struct spot_core {
+    int n;
+    int x0;
+    int x1;
+    int y0;
+    int y1;
+};
+
+static inline void core_pixel(struct spot_core *pc, hw *phw, int x, int y)
+{
+    if (phw->keepout(x, y, 1))
+        return;
+    pc->n++;
+    pc->x0 = std::min(pc->x0, x);
+    pc->x1 = std::max(pc->x1, x);
+    pc->y0 = std::min(pc->y0, y);
+    pc->y1 = std::max(pc->y1, y);
+}
+
+// Most of the window is dark, 16 pixels at a time skips it
+static void scan_core(const Mat &frame, Rect r, hw *phw,
+                      struct spot_core *pc)
+{
+    const v16u8 level = splat16(spot_level);
+    int xe = r.x + r.width;
+
+    for (int y = r.y; y < r.y + r.height; y++) {
+        const uint8_t *p = frame.ptr(y);
+        int x = r.x;
+        for (; x + 16 <= xe; x += 16) {
+            if (!any16((v16u8)(load16(p + x) > level)))
+                continue;
+            for (int i = x; i < x + 16; i++)
+                if (p[i] > spot_level)
+                    core_pixel(pc, phw, i, y);
+        }
+        for (; x < xe; x++)
+            if (p[x] > spot_level)
+                core_pixel(pc, phw, x, y);
+    }
+}
+
+bool find_spot(const Mat &frame, Rect r, hw *phw, Point2d &center,
+               Rect &box, int *pnpix)
+{
+    struct spot_core core;
+
+    r &= Rect(0, 0, frame.cols, frame.rows);
+    if (r.width <= 0 || r.height <= 0)
+        return false;
+    core.n = 0;
+    core.x0 = frame.cols;
+    core.x1 = -1;
+    core.y0 = frame.rows;
+    core.y1 = -1;
+    scan_core(frame, r, phw, &core);
+
+    if (core.n < spot_min_pix || core.n > spot_max_pix)
+        return false;
+    if (core.x1 - core.x0 >= spot_max_dim ||
+        core.y1 - core.y0 >= spot_max_dim) {
+        DPRINTF("find_spot: %d saturated pixels spread over %dx%d\n",
+                core.n, core.x1 - core.x0 + 1, core.y1 - core.y0 + 1);
+        return false;
+    }
+
+    // The edge of the spot falls off over a couple of pixels
+    box = Rect(core.x0 - 2, core.y0 - 2,
+               core.x1 - core.x0 + 5, core.y1 - core.y0 + 5);
+    box &= Rect(0, 0, frame.cols, frame.rows);
+    uint64_t wtot = 0;
+    uint64_t xtot = 0;
+    uint64_t ytot = 0;
+    for (int y = box.y; y < box.y + box.height; y++) {
+        const uint8_t *p = frame.ptr(y);
+        for (int x = box.x; x < box.x + box.width; x++) {
+            int w = p[x] - spot_floor;
+            if (w > 0) {
+                wtot += w;
+                xtot += (uint64_t)w * x;
+                ytot += (uint64_t)w * y;
+            }
+        }
+    }
+    center.x = (double)xtot / wtot;
+    center.y = (double)ytot / wtot;
+    *pnpix = core.n;
+    DPRINTF("find_spot: %d pixels at %6.1lf %6.1lf frame %d\n",
+            core.n, center.x, center.y, frame_index);
+    return true;
+}
@@ -0,0 +1,34 @@
+/* 
+ * Copyright 2016 Robert Bond
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+// Laser spot detection on the raw frame, full size frame pixels
+const int spot_level = 250;           // Saturated, part of the spot core
+const int spot_floor = 200;           // Edge pixels that weight the centroid
+const int spot_min_pix = 60;          // Smaller cores aren't the laser
+const int spot_max_pix = 2500;
+const int spot_max_dim = 64;          // Widest core that is one spot
+const int spot_window = 100;          // First search window around the target
+const int spot_max_window = 800;      // Widest window when widening
+
+/*
+ * Finds the laser as a core of saturated pixels in r of the frame,
+ * with no help from the background model. The center is weighted by
+ * how bright each pixel of the core and its edge is, so it is good to
+ * a fraction of a pixel. Returns false if r has no core, or one that
+ * is too small, too big or spread out to be a single spot.
+ */
+bool find_spot(const Mat &frame, Rect r, hw *phw, Point2d &center,
+               Rect &box, int *pnpix);
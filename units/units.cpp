@@ -27,6 +27,7 @@
 #include "opencv2/core/core.hpp"
 #include "opencv2/gpu/gpu.hpp"
 #include "opencv2/highgui/highgui.hpp"
+#include "opencv2/imgproc/imgproc.hpp"
 
 using namespace std;
 using namespace cv;
@@ -38,52 +39,97 @@ using namespace cv::gpu;
 #include "ants.h"
 #include "blobs.h"
 #include "player.h"
+#include "capture.h"
+#include "v4l2.h"
+#include "rawfile.h"
+#include "fgcache.h"
+#include "idle.h"
+#include "spot.h"
+#include "vibe_cpu.h"
+#include "occupancy.h"
+#include "background.h"
+#include "pool.h"
+#include "kernels.h"
 
 // options
 bool accurate = false;
 bool alternate_frame = false;
+bool cpu_vibe = false;
 bool dont_correct = false;
 bool draw_laser = false;
 bool fake_laser = false;
+bool fake_camera = false;
+bool half_res = false;
+bool idle_mode = false;
+bool cache_fg = false;
 bool overlay_laser = false;
 bool movie = false;
+bool raw_movie = false;
 bool no_ants = false;
 bool neural_class = false;
+bool native_class = false;
+bool int8_class = false;
 bool play_ants = false;
 bool plot_predictions = false;
 bool random_moves = false;
+bool spot_laser = false;
+bool rle_labeling = false;
+bool record_frames = false;
 bool show_mog = false;
 bool take_snapshots = false;
+bool track_roi = false;
+bool v4l2_camera = false;
 bool sql_backlash = false;
 bool verbose = false;
+bool warm_restart = false;
+int v4l2_queue_depth = 2;
 
+// Options with a number after them set *ival instead of *vbl
 struct option {
     const char *opt;
     bool *vbl;
     const char *msg;
+    int *ival;
 } opts[] = {
     { "-a", &alternate_frame, "Alternate frame display enabled" },
+    { "-B", &cache_fg, "Cache fg masks next to the movie, reuse them on replays" },
     { "-c", &accurate, "Repeat corrections until loop closed" },
+    { "-C", &cpu_vibe, "Background subtraction on the cpu" },
     { "-d", &dont_correct, "Don't do closed loop corrections" },
+    { "-D", &spot_laser, "Find the laser as a saturated spot in the frame" },
+    { "-e", &native_class, "Classify with the built in CNN, not Caffe (needs -N)" },
     { "-f", &fake_laser, "Fake the laser coms" },
+    { "-F", &fake_camera, "Fake camera from /home/rgb/frames.raw" },
+    { "-H", &half_res, "Half resolution fg, full resolution refinement" },
+    { "-i", &idle_mode, "Idle at a low frame rate when nothing moves" },
     { "-l", &draw_laser, "Draw the laser on the screen" },
+    { "-L", &rle_labeling, "Label blobs with run length union find" },
     { "-O", &overlay_laser, "Overlay the laser on a movie" },
     { "-o", &show_mog, "Show mog window enabled" },
     { "-m", &movie, "Use /media/rgb/6633-6433/ants.avi as source" },
+    { "-M", &raw_movie, "Use /home/rgb/ants.raw as the movie, no decoding" },
     { "-n", &no_ants, "No ants" },
     { "-N", &neural_class, "Use neural network to classify images" },
     { "-p", &play_ants, "Replay ants from recorded positions" },
     { "-P", &plot_predictions, "Plot predictions for ant movement" },
+    { "-q", &int8_class, "Run the built in CNN in int8 (implies -e)" },
+    { "-Q", NULL, "V4L2 buffers queued at once (with -V)", &v4l2_queue_depth },
     { "-r", &random_moves, "Do random moves" },
+    { "-R", &record_frames, "Record camera frames to /home/rgb/record.raw" },
     { "-s", &sql_backlash, "Save sql formatted backlash data" },
     { "-S", &take_snapshots, "Take snapshots of the ants and laser" },
+    { "-V", &v4l2_camera, "Read the camera with V4L2 mmap buffers" },
+    { "-T", &track_roi, "Between full frames only look near the tracks" },
     { "-v", &verbose, "Verbose logging" },
+    { "-W", &warm_restart, "Keep the bg model in /home/rgb/bg.model (needs -C)" },
     { NULL, NULL, NULL }
 };
 
 // Need something better than these globals
 int frame_index = 0;
-uint64_t frame_ticks = 0;
+uint64_t frame_ticks = 0;               // Capture time of the current frame
+uint64_t grab_ticks = 0;                // When it was grabbed
+uint64_t now_ticks();
 double total_frame_time = 0;
 double average_frame_time = 0;
 double tps;
@@ -96,6 +142,7 @@ snapshots *psnap;
 image_classifier *pclass;
 bool mouse_click;
 running_average laser_frame_lag(10);
+background bg;
 
 static void onMouse(int event, int px, int py, int flags, void* userdata)
 {
@@ -133,19 +180,31 @@ void move_randomly(bool *pdone)
     }
 
     --count;
-    int px = round(normal(640, 100));
-    int py = round(normal(480, 75));
-    px = px > 100 ? px : 100;
-    px = px < 1180 ? px : 1180;
-    py = py > 100 ? py : 100;
-    py = py < 860 ? py : 860;
+    // Tuned on the 1280x960 frame: sigma 100 by 75, 100 pixel margins
+    int px, py;
+    int mx = xpix * 100 / 1280;
+    int my = ypix * 100 / 960;
+    for (int tries = 0; ; tries++) {
+        px = round(normal(xpix/2, xpix/12.8));
+        py = round(normal(ypix/2, ypix/12.8));
+        px = px > mx ? px : mx;
+        px = px < xpix - mx ? px : xpix - mx;
+        py = py > my ? py : my;
+        py = py < ypix - my ? py : ypix - my;
+        if (!phw->keepout(px, py, 1))
+            break;
+        if (tries == 100)
+            return;
+    }
     phw->do_move(px, py, frame_index, "random move");
 }
 
 
+// This frame's blobs, from pan->find_blobs()
+struct rec_list *frame_blobs;
+
 bool ant_looker(bool do_move)
 {
-    struct rec_list *precs;
     int px, py;
     bool retval = false;
     struct ant_list *best_ant;
@@ -153,10 +212,14 @@ bool ant_looker(bool do_move)
     if (no_ants)
         return false;
 
-    best_ant = pan->select_ant();
+    best_ant = pan->select_ant(frame_blobs);
 
     if (do_move && best_ant != NULL) {
         pan->predict_next_pos(best_ant, &px, &py);
+        if (phw->keepout(px, py, 1)) {
+            DPRINTF("ant_looker: %4d %4d in keepout\n", px, py);
+            return false;
+        }
         DPRINTF("ant_looker: %4d %4d frame: %d\n", px, py, frame_index);
         phw->do_move(px, py, frame_index, "  ant");
         retval = true;
@@ -165,52 +228,72 @@ bool ant_looker(bool do_move)
     return retval;
 }
 
-// Laser blobs are full of bright pixels.
-#define LT 250
-inline bool laser_blob(const struct rec_list *pn, Mat &frame, Mat &fg)
+// Laser blobs are full of bright pixels, find_blobs counted them
+inline bool laser_blob(const struct rec_list *pn, int scale)
 {
     if (neural_class) {
-        std::vector<float> image_type;
-        image_type = pclass->get_image_type(&frame, Point(pn->xc, pn->yc));
-        return image_type[laser_index] > 0.9f;
+        if (pn->rejected || pn->npix * scale * scale <= laser_min_pix)
+            return false;
+        return pn->image_type[laser_index] > 0.9f;
     } else {
-        int lcount = 0;
-        // cout << "laser_blob looking at " << pn->rect << endl;
-        for (int y = pn->rect.y; y < pn->rect.y + pn->rect.height; y++) {
-            for (int x = pn->rect.x; x < pn->rect.x + pn->rect.width; x++) {
-                if (fg.at<uchar>(y, x) == LT && frame.at<uchar>(y, x) > LT)
-                    lcount++;
-                DPRINTF("%3d ", frame.at<uchar>(y, x));
-            }
-            DPRINTF("\n");
-        }
-        DPRINTF("laser_blob counted %d\n", lcount);
-        return lcount > 60;
+        DPRINTF("laser_blob counted %d\n", pn->bright);
+        return pn->kind == blob_laser;
     }
 }
 
-bool find_laser(Mat &frame, Mat& fg, int xc, int yc, int size, Point &center, Rect &r)
+// Centroid of the saturated pixels in r, from the full size frame
+static void laser_center(Mat &frame, Rect r, Point &center)
 {
-    int half_size = size/2;
-    int xs = std::max(xc - half_size, 0);
-    int ys = std::max(yc - half_size, 0);
-    int xe = std::min(xc + half_size, fg.cols);
-    int ye = std::min(yc + half_size, fg.rows);
+    uint64_t xtot = 0;
+    uint64_t ytot = 0;
+    int n = 0;
+
+    r &= Rect(0, 0, frame.cols, frame.rows);
+    for (int y = r.y; y < r.y + r.height; y++) {
+        uint64_t xs;
+        uint32_t c = kern->sum_above(frame.ptr(y) + r.x, r.width,
+                                     blob_bright, &xs);
+        xtot += (uint64_t)r.x * c + xs;
+        ytot += (uint64_t)y * c;
+        n += c;
+    }
+    if (n) {
+        center.x = xtot / n;
+        center.y = ytot / n;
+    }
+}
 
-    Rect roi(Point(xs, ys), Point(xe, ye));
+// xc, yc and size are in frame pixels, fg may be smaller. Looks
+// through frame_blobs unless the laser is found as a spot.
+bool find_laser(Mat &frame, Mat& fg, int xc, int yc, int size, Point &center, Rect &r)
+{
+    if (spot_laser) {
+        Point2d c;
+        int npix;
+        Rect roi(xc - size/2, yc - size/2, size, size);
+        if (!find_spot(frame, roi, phw, c, r, &npix))
+            return false;
+        center.x = (int)round(c.x);
+        center.y = (int)round(c.y);
+        if (take_snapshots)
+            psnap->snap_laser(center);
+        return true;
+    }
 
-    struct rec_list *blobs = find_bbb(fg, roi, phw, 250); 
+    int scale = xpix / fg.cols;
+    Rect roi(xc - size/2, yc - size/2, size, size);
 
-    // Check to see which blobs might be the laser
+    // Check to see which blobs in the window might be the laser
     bool got_laser = false;
-    while(blobs) {
-        struct rec_list *pn = blobs;
-
-        if (got_laser == false && pn->npix > 80) {
-                if (laser_blob(pn, frame, fg)) {
+    for (struct rec_list *pn = frame_blobs; pn; pn = pn->pnext) {
+        Rect in = pn->rect & roi;
+        if (got_laser == false && in.width > 0 && in.height > 0) {
+                if (laser_blob(pn, scale)) {
                     center.x = pn->xc;
                     center.y = pn->yc;
                     r = pn->rect;
+                    if (scale > 1)
+                        laser_center(frame, r, center);
                     got_laser = true;
                     if (take_snapshots)
                         psnap->snap_laser(center);
@@ -218,14 +301,24 @@ bool find_laser(Mat &frame, Mat& fg, int xc, int yc, int size, Point &center, Re
                             center.x, center.y, pn->npix);
             }
         }
-
-        blobs = blobs->pnext;
-        delete pn;
     }
 
     return got_laser;
 }
 
+// The window around the target doubles until the laser shows up. Only
+// while the laser is on, when it's off the first window says so.
+bool search_laser(Mat &frame, Mat &fg, int xc, int yc, Point &center, Rect &r)
+{
+    for (int size = spot_window; ; size *= 2) {
+        if (find_laser(frame, fg, xc, yc, size, center, r))
+            return true;
+        if (!plas->laser_is_on() || size >= spot_max_window)
+            return false;
+        DPRINTF("search_laser: no spot in %d window\n", size);
+    }
+}
+
 // Returns true if moved laser
 bool correct(Mat& frame, Point &center, Rect &box)
 {
@@ -259,72 +352,286 @@ inline int border(int i)
     return (int)round(0.000362 * x * x  - 0.511 * x + 220.732)/2;
 }
 
-VIBE_GPU vibe;
+// 2 with -H, fg is then half the frame size
+int pipe_scale = 1;
 
-// Main pixel porcessing
-void process_frame(VideoCapture &ccap, VideoCapture &mcap,
-                   Mat &frame, Mat &fg, Mat &half, Mat &half_fg)
-{
+// Long lived buffers for process_frame
+frame_pool pool;
+GpuMat d_frame;
+GpuMat d_fg;
+GpuMat d_overlay;
+GpuMat d_half;
+GpuMat d_half_fg;
 
+void setup_pool(Mat &frame, Mat &fg, Mat &half, Mat &half_fg)
+{
+    // Camera frames live in the capture ring, raw replays in the mmap
+    if (movie && !raw_movie)
+        pool.host(&frame, ypix, xpix, CV_8UC1);
+    pool.host(&fg, ypix/pipe_scale, xpix/pipe_scale, CV_8UC1);
+    pool.host(&half, ypix/2, xpix/2, CV_8UC1);
+    pool.host(&half_fg, ypix/2, xpix/2, CV_8UC1);
+    if (cpu_vibe)
+        return;
+    pool.dev(&d_frame, ypix, xpix, CV_8UC1);
+    pool.dev(&d_fg, ypix/pipe_scale, xpix/pipe_scale, CV_8UC1);
+    pool.dev(&d_half, ypix/2, xpix/2, CV_8UC1);
+    pool.dev(&d_half_fg, ypix/2, xpix/2, CV_8UC1);
+    if (overlay_laser)
+        pool.dev(&d_overlay, ypix, xpix, CV_8UC1);
+}
 
-    if (movie)
-        mcap.read(frame);
-    else
-        ccap.read(frame);
+// -T looks at the whole frame for new ants every roi_full_frames
+const int roi_full_frames = 8;
+uint64_t *roi_bits = NULL;
 
-    if (frame.empty()) {
-        printf("Can't read a movie frame!\n");
-        exit(1);
+/*
+ * Tiles around where each track should be by now and around the
+ * laser target, or NULL for a full frame. A track's window grows with
+ * its speed and how long ago it was last seen.
+ */
+const uint64_t *track_rois()
+{
+    struct fg_occupancy *po = bg.occupancy();
+
+    if (!track_roi || frame_index % roi_full_frames == 0 || !po->bits)
+        return NULL;
+    if (!roi_bits)
+        roi_bits = new uint64_t[po->tiles_y];
+    memset(roi_bits, 0, po->tiles_y * sizeof(roi_bits[0]));
+
+    for (struct ant_list *pant = pan->all_ants(); pant; pant = pant->next) {
+        double age = (double)(now_ticks() - pant->last_frame_ticks)/tps +
+                     average_frame_time;
+        double speed = pant->avg_speed.average();
+        Point2d uv = pant->uv.average();
+        int x = pant->last.x + (int)(uv.x * speed * age);
+        int y = pant->last.y + (int)(uv.y * speed * age);
+        int r = close_blob + (int)(speed * age);
+        occ_mark(po, roi_bits, Rect((x - r) / pipe_scale, (y - r) / pipe_scale,
+                                    2 * r / pipe_scale, 2 * r / pipe_scale));
     }
+    // Same window find_laser uses
+    occ_mark(po, roi_bits, Rect((phw->target.px - spot_window/2) / pipe_scale,
+                                (phw->target.py - spot_window/2) / pipe_scale,
+                                spot_window / pipe_scale,
+                                spot_window / pipe_scale));
 
-    if (draw_laser)
-        plas->draw_laser(frame);
-
-    if (play_ants)
-        play->add_ant(frame);
+    if (verbose) {
+        int n = 0;
+        for (int ty = 0; ty < po->tiles_y; ty++)
+            n += __builtin_popcountll(roi_bits[ty]);
+        DPRINTF("track_rois: %d of %d tiles\n", n, po->tiles_x * po->tiles_y);
+    }
+    return roi_bits;
+}
 
+// fg/bg on the gpu
+void process_gpu(Mat &frame, Mat *poverlay, Mat &fg, Mat &half, Mat &half_fg,
+                 const uint64_t *active)
+{
     // Load up the frames
-    GpuMat d_frame(frame);
-    GpuMat d_tmp;
-    if (movie && overlay_laser) {
-        Mat overlay;
-        ccap.read(overlay);
-        if (overlay.empty()) {
-            printf("Can't read an overlay frame!\n");
-            exit(1);
-        }
-        GpuMat d_overlay(overlay);
+    d_frame.upload(frame);
+    if (poverlay) {
+        d_overlay.upload(*poverlay);
         gpu::threshold(d_overlay, d_overlay, 250.0, 255.0, THRESH_BINARY); 
         gpu::bitwise_or(d_overlay, d_frame, d_frame);
         d_frame.download(frame);
     }
 
-    // Process fg/bg
-    GpuMat d_fg;
-    vibe.operator()(d_frame, d_fg);
-    if (countNonZero(d_fg, d_tmp) > 1000) {
-        // The bg processing blew up...
-        printf("Background frame reset!\n");
-        vibe.initialize(d_frame);
-        d_fg = Scalar(0); // No pixels this frame
+    // Process fg/bg, at half size the display frame is the input
+    if (half_res) {
+        gpu::pyrDown(d_frame, d_half);
+        bg.apply_gpu(d_half, d_fg, fg, active);
+        if (verbose)
+            d_half.download(half);
+        if (verbose && show_mog)
+            fg.copyTo(half_fg);
+        return;
     }
-
-    d_fg.download(fg);
+    bg.apply_gpu(d_frame, d_fg, fg, active);
 
     // Make a displayable frame
     if (verbose) {
-        GpuMat d_half;
         gpu::pyrDown(d_frame, d_half);
         d_half.download(half);
     }
 
     // Setup mog display
     if (verbose && show_mog) {
-        GpuMat d_half_fg;
         gpu::pyrDown(d_fg, d_half_fg);
         d_half_fg.download(half_fg);
     }
+}
+
+// Same thing for boxes without a gpu
+void process_cpu(Mat &frame, Mat *poverlay, Mat &fg, Mat &half, Mat &half_fg,
+                 const uint64_t *active)
+{
+    if (poverlay) {
+        cv::threshold(*poverlay, *poverlay, 250.0, 255.0, THRESH_BINARY);
+        cv::bitwise_or(*poverlay, frame, frame);
+    }
+
+    if (half_res) {
+        cv::pyrDown(frame, half);
+        bg.apply_cpu(half, fg, active);
+        if (verbose && show_mog)
+            fg.copyTo(half_fg);
+        return;
+    }
+    bg.apply_cpu(frame, fg, active);
+
+    if (verbose)
+        cv::pyrDown(frame, half);
+
+    if (verbose && show_mog)
+        cv::pyrDown(fg, half_fg);
+}
+
+// Camera frames come from V4L2 or the fake when one is open
+raw_source *psrc = NULL;
+const double fake_fps = 15.0;
+
+// Raw frame containers, see rawfile.h
+raw_recorder *precorder = NULL;
+raw_replay *preplay = NULL;
+
+// fg masks of the movie, indexed by movie frame
+fg_cache *pfgc = NULL;
+uint32_t movie_frame = 0;             // Index of the current movie frame
+uint32_t movie_reads = 0;
+
+// Duty cycling for -i
+idle_gate gate;
+
+// Saved background model for fast restarts
+const char *model_path = "/home/rgb/bg.model";
+const double model_save_secs = 300.0;
+
+// Main loop trips before heap allocations start counting
+const int heap_warm_loops = 100;
+
+static void read_camera(capture &ccap, Mat &frame, uint64_t *pticks)
+{
+    if (psrc) {
+        if (!psrc->grab(frame, pticks))
+            frame.release();
+    } else {
+        ccap.read(frame, pticks);
+    }
+}
+
+/*
+ * The clock frame_ticks runs on. A raw replay keeps the recorded
+ * capture times so tracking sees the same frame spacing the live run
+ * did, however fast it plays. Now is then the frame's capture time
+ * plus how long it has been in the pipeline.
+ */
+uint64_t now_ticks()
+{
+    if (preplay)
+        return frame_ticks + (getTickCount() - grab_ticks);
+    return getTickCount();
+}
+
+// Next frame from the movie or the camera
+void grab_frame(capture &ccap, VideoCapture &mcap, Mat &frame)
+{
+    uint64_t ticks;
+
+    grab_ticks = getTickCount();
+    if (movie && preplay) {
+        if (preplay->grab(frame, &ticks)) {
+            const struct raw_meta *pm = preplay->meta();
+            DPRINTF("replay: frame %u state %d target %d %d laser %s\n",
+                    pm->index, pm->state, pm->target_px, pm->target_py,
+                    pm->laser_on ? "on" : "off");
+        } else {
+            frame.release();
+        }
+        movie_frame = movie_reads++;
+    } else if (movie) {
+        mcap.read(frame);
+        ticks = getTickCount();
+        movie_frame = movie_reads++;
+    } else {
+        read_camera(ccap, frame, &ticks);
+        if (precorder && !frame.empty())
+            precorder->stage(frame, ticks);
+    }
+    frame_ticks = ticks;                // exported to ants.cpp
+
+    if (frame.empty()) {
+        printf("Can't read a movie frame!\n");
+        exit(1);
+    }
+
+    if (draw_laser)
+        plas->draw_laser(frame);
+
+    if (play_ants)
+        play->add_ant(frame);
+}
+
+// Metadata for the frame grab_frame staged, state is the main loop's
+void record_frame(int state)
+{
+    if (!precorder)
+        return;
+    struct raw_meta meta;
+    meta.index = frame_index;
+    meta.target_px = phw->target.px;
+    meta.target_py = phw->target.py;
+    meta.state = state;
+    meta.laser_on = plas->laser_is_on();
+    precorder->append(&meta);
+}
+
+// Background subtraction and the display frames
+void process_pixels(capture &ccap, Mat &frame, Mat &fg, Mat &half, Mat &half_fg)
+{
+    Mat overlay;
+    Mat *poverlay = NULL;
+    if (movie && overlay_laser) {
+        uint64_t overlay_ticks;
+        read_camera(ccap, overlay, &overlay_ticks);
+        if (overlay.empty()) {
+            printf("Can't read an overlay frame!\n");
+            exit(1);
+        }
+        poverlay = &overlay;
+    }
 
+    if (pfgc && pfgc->load(movie_frame, fg)) {
+        bg.apply_cached(fg);
+        if (verbose)
+            cv::pyrDown(frame, half);
+        if (verbose && show_mog && half_res)
+            fg.copyTo(half_fg);
+        else if (verbose && show_mog)
+            cv::pyrDown(fg, half_fg);
+    } else {
+        if (cpu_vibe)
+            process_cpu(frame, poverlay, fg, half, half_fg, track_rois());
+        else
+            process_gpu(frame, poverlay, fg, half, half_fg, track_rois());
+        if (pfgc)
+            pfgc->save(movie_frame, fg);
+    }
+
+    int moved = pool.moved();
+    if (moved)
+        DPRINTF("frame_pool: %d buffers reallocated, frame %d\n",
+                moved, frame_index);
+}
+
+// Main pixel porcessing
+void process_frame(capture &ccap, VideoCapture &mcap,
+                   Mat &frame, Mat &fg, Mat &half, Mat &half_fg)
+{
+    grab_frame(ccap, mcap, frame);
+    process_pixels(ccap, frame, fg, half, half_fg);
 }
    
 int main(int argc, char* argv[])
@@ -336,35 +643,112 @@ int main(int argc, char* argv[])
     Mat half;
     Mat half_fg;
     uint32_t frame_count = 1000000; 
+    int cam_cols = default_xpix;
+    int cam_rows = default_ypix;
 
     printf("units\n");
 
     ++argv;
     while (--argc) {
+        // Two numbers, so not in the table
+        if (strcmp(*argv, "-x") == 0) {
+            int n = 0;
+            if (argc < 2 ||
+                sscanf(argv[1], "%dx%d%n", &cam_cols, &cam_rows, &n) != 2 ||
+                argv[1][n] != 0) {
+                printf("-x wants <cols>x<rows>\n");
+                return -1;
+            }
+            printf("Camera at %dx%d\n", cam_cols, cam_rows);
+            argv += 2;
+            argc--;
+            continue;
+        }
         for (struct option *p = opts; p->opt; p++) {
-            if (strcmp(*argv, p->opt) == 0) {
-                *p->vbl = true;
-                printf("%s\n", p->msg);
+            if (strcmp(*argv, p->opt) != 0)
+                continue;
+            if (p->ival) {
+                int n = 0;
+                if (argc < 2 || sscanf(argv[1], "%d%n", p->ival, &n) != 1 ||
+                    argv[1][n] != 0) {
+                    printf("%s wants a number\n", p->opt);
+                    return -1;
+                }
+                printf("%s: %d\n", p->msg, *p->ival);
+                argv++;
+                argc--;
+                break;
             }
+            *p->vbl = true;
+            printf("%s\n", p->msg);
         }
         argv++;
     }
+    if (raw_movie)
+        movie = true;
+    if (half_res)
+        pipe_scale = 2;
+    // The cached fg would be wrong if anything is drawn on the frames
+    if (cache_fg && (!movie || overlay_laser || draw_laser || play_ants)) {
+        printf("fg cache needs -m or -M without -O, -l or -p\n");
+        cache_fg = false;
+    }
+    // The cache has to hold whole frames
+    if (track_roi && cache_fg) {
+        printf("-T is off while caching fg\n");
+        track_roi = false;
+    }
+    // Only the cpu model can be saved, and only the live scene is worth it
+    if (warm_restart && (!cpu_vibe || movie)) {
+        printf("warm restart needs -C and the camera\n");
+        warm_restart = false;
+    }
+
+    // The movie's frames set the size, the camera is asked for cam_cols
+    // by cam_rows. Everything sized by xpix and ypix comes after this.
+    const char *movie_path = raw_movie ? "/home/rgb/ants.raw" :
+                                         "/home/rgb/ants2.avi";
+    // The movie video file
+    VideoCapture mcap;
+    if (raw_movie) {
+        preplay = new raw_replay();
+        if (!preplay->open(movie_path)) {
+             cout << "Cannot open the raw movie" << endl;
+             return -1;
+        }
+        cam_cols = preplay->size().width;
+        cam_rows = preplay->size().height;
+    } else if (movie) {
+        // mcap.open("/media/rgb/6633-6433/ants.avi");
+        mcap.open(movie_path);
+        if (!mcap.isOpened()) {
+             cout << "Cannot open the video file" << endl;
+             return -1;
+        }
+        cam_cols = (int)mcap.get(CV_CAP_PROP_FRAME_WIDTH);
+        cam_rows = (int)mcap.get(CV_CAP_PROP_FRAME_HEIGHT);
+    }
+    if (!set_resolution(cam_cols, cam_rows))
+        return -1;
     fflush(stdout);
 
     pbl = new backlash();
     phw = new hw(pbl);
+    phw->load_keepout(KEEPOUT_FILE);
     plas = new laser(phw, false);
-    pclass = new image_classifier();
+    if (neural_class) {
+        pclass = new image_classifier(native_class || int8_class, int8_class);
+        printf("Classifying with %s\n", pclass->engine());
+    }
     if (take_snapshots)
         psnap = new snapshots(&frame);
-    pan = new ants(phw, &frame, &fg, &half_fg, psnap, pclass);
+    pan = new ants(phw, &frame, &fg, &half_fg, bg.occupancy(), psnap, pclass);
     if (play_ants)
         play = new player("ants.pos"); 
+    setup_pool(frame, fg, half, half_fg);
 
-    // The camera video file for reading
-    VideoCapture ccap;
-    // The movie video file
-    VideoCapture mcap;
+    // The camera, read on its own thread
+    capture ccap;
 
     if (verbose) {
         namedWindow("Units", CV_WINDOW_AUTOSIZE);
@@ -377,36 +761,74 @@ int main(int argc, char* argv[])
     if (show_mog)
         namedWindow("mog", CV_WINDOW_AUTOSIZE);
 
-    if (movie) {
-        // mcap.open("/media/rgb/6633-6433/ants.avi");
-        mcap.open("/home/rgb/ants2.avi");
+    if (raw_movie) {
+        // Nothing is skipped, but startup uses up a few frames
+        frame_count = preplay->frames();
+        frame_count -= frame_count / 20;
+        printf("%u frames in the movie\n", frame_count);
+        phw->pxy_to_loc(xpix/2, ypix/2, &phw->cur_loc);
+        phw->do_move(xpix/2, ypix/2, frame_index, "Start");
+    } else if (movie) {
         frame_count = (uint32_t)mcap.get(CV_CAP_PROP_FRAME_COUNT);
         // account for a few skipped frames;
         frame_count -= frame_count / 20;
         printf("%u frames in the movie\n", frame_count);
         phw->pxy_to_loc(xpix/2, ypix/2, &phw->cur_loc);
         phw->do_move(xpix/2, ypix/2, frame_index, "Start");
-        if (!mcap.isOpened()) {
-             cout << "Cannot open the video file" << endl;
+    }
+    if ((!movie || overlay_laser) && v4l2_camera) {
+        v4l2_source *pv = new v4l2_source();
+        if (!pv->open("/dev/video0", xpix, ypix, v4l2_queue_depth)) {
+             cout << "Cannot open the camera" << endl;
              return -1;
         }
-    }
-    if (!movie || overlay_laser) {
-        ccap.open(0);
+        psrc = pv;
+    } else if ((!movie || overlay_laser) && fake_camera) {
+        file_source *pf = new file_source();
+        if (!pf->open("/home/rgb/frames.raw", xpix, ypix, fake_fps)) {
+             cout << "Cannot open the fake camera" << endl;
+             return -1;
+        }
+        psrc = pf;
+    } else if (!movie || overlay_laser) {
+        ccap.open(0, xpix, ypix);
         if (!ccap.isOpened()) {
              cout << "Cannot open the video file" << endl;
              return -1;
         }
     }
 
+    if (cache_fg) {
+        pfgc = new fg_cache();
+        if (!pfgc->open(movie_path, xpix/pipe_scale, ypix/pipe_scale)) {
+            delete pfgc;
+            pfgc = NULL;
+        }
+    }
+
+    if (record_frames && !movie) {
+        precorder = new raw_recorder();
+        if (!precorder->open("/home/rgb/record.raw", xpix, ypix)) {
+             cout << "Cannot open the recording" << endl;
+             return -1;
+        }
+    }
+
     // Get things running
     //    Warm up the fg/bg window
     //    Then fire up the laser
     //    Give it a couple of frames for the laser to start
-    for (int i = 0; i < 5 || !phw->hw_idle(); i++) {
+    //    A saved model that still matches needs no warming up
+    if (warm_restart)
+        bg.load_model(model_path);
+    int warm_frames = 5;
+    for (int i = 0; i < warm_frames || !phw->hw_idle(); i++) {
         process_frame(ccap, mcap, frame, fg, half, half_fg);
 
-        if (i == 3)
+        if (i == 0 && bg.warm())
+            warm_frames = 2;
+
+        if (i == warm_frames - 2)
             plas->laser_on();
 
         if (verbose) {
@@ -424,6 +846,7 @@ int main(int argc, char* argv[])
     bool found_laser = false;
     int ntries = 0;
     while (!found_laser && ntries++ < 20) {
+        frame_mem.reset();
         process_frame(ccap, mcap, frame, fg, half, half_fg);
         if (verbose) {
             imshow("Units", half);
@@ -438,10 +861,11 @@ int main(int argc, char* argv[])
             }
         }
 
+        frame_blobs = pan->find_blobs();
         if (find_laser(frame, fg, xpix/2, ypix/2, xpix, lcenter, lbox))
             found_laser = true;
-
-        sleep(1);
+        else
+            sleep(1);
     }
 
     if (found_laser) {
@@ -486,17 +910,52 @@ int main(int argc, char* argv[])
     tps = getTickFrequency();
     int laser_on_frame = 0;
     laser_frame_lag.add_item(3);
+    double last_model_save = getTickCount()/tps;
+    int loops = 0;
 
     while(!done) {
 		double dt;
         Point left, right, top, bottom;
         bool laser_vis = false;
         double tstart, tpix, twork, tend;
-        frame_ticks = getTickCount();       // exported to ants.cpp
-        tstart = frame_ticks/tps;
+        tstart = getTickCount()/tps;
         int laser_frame_delay;
 
-        process_frame(ccap, mcap, frame, fg, half, half_fg);
+        // Last frame's blobs and classifier results
+        frame_mem.reset();
+        frame_blobs = NULL;
+
+        // From here on the loop shouldn't touch the heap
+        if (++loops == heap_warm_loops)
+            heap_watch();
+
+        grab_frame(ccap, mcap, frame);
+
+        // Nothing else happens until something moves
+        if (gate.idle()) {
+            if (gate.motion(frame)) {
+                gate.wake();
+            } else {
+                frame_index++;
+                if (!--frame_count)
+                    done = true;
+                if (gate.refresh_bg())
+                    process_pixels(ccap, frame, fg, half, half_fg);
+                double busy = getTickCount()/tps - tstart;
+                double slept = 0.0;
+                if (busy < idle_period) {
+                    slept = idle_period - busy;
+                    usleep((useconds_t)(slept * 1e6));
+                }
+                gate.account(busy, slept);
+                record_frame(raw_state_idle);
+                if (verbose && (waitKey(1) & 0xff) == 27)
+                    done = true;
+                continue;
+            }
+        }
+
+        process_pixels(ccap, frame, fg, half, half_fg);
 
         tpix = getTickCount()/tps;
         frame_index++;
@@ -512,10 +971,15 @@ int main(int argc, char* argv[])
         enum state next_state = cur_state;
         DPRINTF("cur_state: %s\n", state_labels[cur_state]);
 
+        // One labeling pass for the laser and the ants, unless
+        // neither needs it
+        if (!no_ants || !spot_laser)
+            frame_blobs = pan->find_blobs();
+
         Point lcenter;
         Rect lbox;
-        laser_vis = find_laser(frame, fg, phw->target.px,
-                               phw->target.py, 100, lcenter, lbox);
+        laser_vis = search_laser(frame, fg, phw->target.px,
+                                 phw->target.py, lcenter, lbox);
 
         if (laser_vis) {
             if (laser_on_frame != 0)
@@ -647,13 +1111,34 @@ int main(int argc, char* argv[])
         total_frame_time += loop_total;
         average_frame_time = total_frame_time / (double) frame_index;
 
-        DPRINTF("Loop time: %d Pix: %d Work: %d Overhead: %d Average: %d frame: %d\n", 
+        DPRINTF("Loop time: %d Pix: %d Work: %d Overhead: %d Average: %d Age: %d Dropped: %u Moved: %u Allocs: %u Arena: %u Fg: %u frame: %d\n", 
                 (int)round((loop_total)*1000.0),
                 (int)round((tpix-tstart)*1000.0),
                 (int)round((twork-tpix)*1000.0),
                 (int)round((tend-twork)*1000.0),
                 (int)round(average_frame_time*1000.0),
+                (int)round((now_ticks() - frame_ticks)/tps*1000.0),
+                psrc ? psrc->dropped() : ccap.dropped(),
+                pool.moves(),
+                heap_allocs(),
+                (uint32_t)frame_mem.used(),
+                bg.occupancy()->npix,
                 frame_index);
+
+        if (idle_mode) {
+            gate.account(tend - tstart, 0.0);
+            gate.quiet(cur_state == idle_laser_off && !laser_vis &&
+                       !random_moves && phw->hw_idle() &&
+                       pan->all_ants() == NULL &&
+                       bg.occupancy()->npix < (uint32_t)idle_fg_pix);
+        }
+
+        if (warm_restart && tend - last_model_save > model_save_secs) {
+            bg.save_model(model_path);
+            last_model_save = tend;
+        }
+
+        record_frame(cur_state);
     }
 
     while (!phw->hw_idle())
@@ -665,7 +1150,34 @@ int main(int argc, char* argv[])
         destroyWindow("mog");
     if (alternate_frame)
         destroyWindow("laser");
-    vibe.release();
+    bg.dump_resets();
+    bbb_report();
+    if (neural_class)
+        pan->class_report();
+    frame_mem.report();
+    printf("Steady state: %u heap allocations, %llu bytes, %u pool buffers moved\n",
+           heap_allocs(), (unsigned long long)heap_bytes(), pool.moves());
+    if (idle_mode)
+        gate.report();
+    if (warm_restart) {
+        bg.wait_model();
+        bg.save_model(model_path);
+        bg.wait_model();
+    }
+    bg.release();
+    ccap.release();
+    if (psrc)
+        psrc->release();
+    if (precorder) {
+        printf("%u frames recorded\n", precorder->frames());
+        precorder->close();
+    }
+    if (preplay)
+        preplay->release();
+    if (pfgc) {
+        printf("%u fg masks from the cache\n", pfgc->hits());
+        pfgc->close();
+    }
     
     exit(0);
 }
@@ -135,6 +135,11 @@ void laser::laser_off(void)
     this->phw->switch_laser(false);
 }
 
+bool laser::laser_is_on(void)
+{
+    return is_on;
+}
+
 void laser::draw_laser(Mat &src)
 {
     if (is_on) {
@@ -47,6 +47,7 @@ class laser {
         laser(hw *phw, bool start);
         void laser_on();
         void laser_off();
+        bool laser_is_on();
         void draw_laser(Mat &src);
     private:
         hw *phw;
@@ -0,0 +1,355 @@
+/* 
+ * Copyright 2016 Robert Bond
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <iostream>
+#include <sys/time.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <math.h>
+#include <errno.h>
+#include <string.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <linux/videodev2.h>
+
+#include "opencv2/core/core.hpp"
+#include "opencv2/highgui/highgui.hpp"
+
+using namespace std;
+using namespace cv;
+
+#include "hw.h"
+#include "v4l2.h"
+
+static int xioctl(int fd, unsigned long req, void *arg)
+{
+    int r;
+    do {
+        r = ioctl(fd, req, arg);
+    } while (r == -1 && errno == EINTR);
+    return r;
+}
+
+v4l2_source::v4l2_source()
+{
+    fd = -1;
+    nbufs = 0;
+    bufs = NULL;
+    held = -1;
+    pixfmt = 0;
+    width = 0;
+    height = 0;
+    bytesperline = 0;
+    ndropped = 0;
+    last_sequence = 0;
+    have_sequence = false;
+}
+
+bool v4l2_source::fail(const char *msg)
+{
+    printf("v4l2: %s: %s\n", msg, strerror(errno));
+    release();
+    return false;
+}
+
+// nbufs driver buffers are queued at once, fewer means less latency.
+// The driver has the last word on how many there are.
+bool v4l2_source::open(const char *dev, int width, int height, int nbufs)
+{
+    // Formats that start with the Y plane need no copy
+    static const uint32_t formats[] = {
+        V4L2_PIX_FMT_GREY,
+        V4L2_PIX_FMT_NV12,
+        V4L2_PIX_FMT_YUV420,
+        V4L2_PIX_FMT_YUYV,
+        0
+    };
+    struct v4l2_format fmt;
+    int i;
+
+    fd = ::open(dev, O_RDWR | O_NONBLOCK);
+    if (fd < 0)
+        return fail(dev);
+
+    for (i = 0; formats[i]; i++) {
+        memset(&fmt, 0, sizeof(fmt));
+        fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        fmt.fmt.pix.width = width;
+        fmt.fmt.pix.height = height;
+        fmt.fmt.pix.pixelformat = formats[i];
+        fmt.fmt.pix.field = V4L2_FIELD_NONE;
+        if (xioctl(fd, VIDIOC_S_FMT, &fmt) == 0 &&
+            fmt.fmt.pix.pixelformat == formats[i])
+            break;
+    }
+    if (!formats[i])
+        return fail("no usable pixel format");
+    if ((int)fmt.fmt.pix.width != width || (int)fmt.fmt.pix.height != height) {
+        printf("v4l2: asked for %dx%d, got %ux%u\n", width, height,
+               fmt.fmt.pix.width, fmt.fmt.pix.height);
+        release();
+        return false;
+    }
+    this->width = width;
+    this->height = height;
+    pixfmt = formats[i];
+    bytesperline = fmt.fmt.pix.bytesperline;
+    if (bytesperline == 0)
+        bytesperline = pixfmt == V4L2_PIX_FMT_YUYV ? width * 2 : width;
+
+    struct v4l2_requestbuffers req;
+    memset(&req, 0, sizeof(req));
+    nbufs = std::max(2, std::min(nbufs, VIDEO_MAX_FRAME));
+    req.count = nbufs;
+    req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    req.memory = V4L2_MEMORY_MMAP;
+    if (xioctl(fd, VIDIOC_REQBUFS, &req) < 0)
+        return fail("VIDIOC_REQBUFS");
+    if (req.count < 2)
+        return fail("not enough buffers");
+    if ((int)req.count != nbufs)
+        printf("v4l2: asked for %d buffers, got %u\n", nbufs, req.count);
+
+    this->nbufs = req.count;
+    bufs = new v4l2_map[this->nbufs];
+    for (int n = 0; n < this->nbufs; n++)
+        bufs[n].start = MAP_FAILED;
+    for (int n = 0; n < this->nbufs; n++) {
+        struct v4l2_buffer buf;
+        memset(&buf, 0, sizeof(buf));
+        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buf.memory = V4L2_MEMORY_MMAP;
+        buf.index = n;
+        if (xioctl(fd, VIDIOC_QUERYBUF, &buf) < 0)
+            return fail("VIDIOC_QUERYBUF");
+        bufs[n].length = buf.length;
+        bufs[n].start = mmap(NULL, buf.length, PROT_READ | PROT_WRITE,
+                             MAP_SHARED, fd, buf.m.offset);
+        if (bufs[n].start == MAP_FAILED)
+            return fail("mmap");
+        if (xioctl(fd, VIDIOC_QBUF, &buf) < 0)
+            return fail("VIDIOC_QBUF");
+    }
+
+    enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    if (xioctl(fd, VIDIOC_STREAMON, &type) < 0)
+        return fail("VIDIOC_STREAMON");
+
+    printf("v4l2: %s %dx%d %.4s, %d buffers\n", dev, width, height,
+           (char *)&pixfmt, this->nbufs);
+    return true;
+}
+
+void v4l2_source::requeue(int index)
+{
+    struct v4l2_buffer buf;
+    memset(&buf, 0, sizeof(buf));
+    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buf.memory = V4L2_MEMORY_MMAP;
+    buf.index = index;
+    if (xioctl(fd, VIDIOC_QBUF, &buf) < 0)
+        printf("v4l2: VIDIOC_QBUF: %s\n", strerror(errno));
+}
+
+// Kernel timestamps are CLOCK_MONOTONIC, same clock as getTickCount()
+static uint64_t buf_ticks(struct v4l2_buffer &buf)
+{
+#ifdef V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC
+    if ((buf.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) ==
+        V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC) {
+        double usecs = buf.timestamp.tv_sec * 1e6 + buf.timestamp.tv_usec;
+        return (uint64_t)(usecs * getTickFrequency() / 1e6);
+    }
+#endif
+    return getTickCount();
+}
+
+bool v4l2_source::grab(Mat &frame, uint64_t *pticks)
+{
+    struct v4l2_buffer buf;
+    struct v4l2_buffer newest;
+    bool got = false;
+
+    // The pipeline is done with the last one
+    if (held >= 0)
+        requeue(held);
+    held = -1;
+
+    // Drain the queue, keeping only the newest frame
+    for (;;) {
+        memset(&buf, 0, sizeof(buf));
+        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buf.memory = V4L2_MEMORY_MMAP;
+        if (xioctl(fd, VIDIOC_DQBUF, &buf) == 0) {
+            if (got)
+                requeue(newest.index);
+            newest = buf;
+            got = true;
+            continue;
+        }
+        if (errno != EAGAIN) {
+            printf("v4l2: VIDIOC_DQBUF: %s\n", strerror(errno));
+            if (got)
+                requeue(newest.index);
+            return false;
+        }
+        if (got)
+            break;
+        struct pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        if (poll(&pfd, 1, 1000) <= 0) {
+            printf("v4l2: no frame from the camera\n");
+            return false;
+        }
+    }
+
+    // Counts what the driver dropped as well as what we skipped
+    if (have_sequence && newest.sequence > last_sequence + 1)
+        ndropped += newest.sequence - last_sequence - 1;
+    last_sequence = newest.sequence;
+    have_sequence = true;
+    held = newest.index;
+
+    uint8_t *p = (uint8_t *)bufs[held].start;
+    if (pixfmt == V4L2_PIX_FMT_YUYV) {
+        // Packed, so the Y bytes have to be picked out
+        y_copy.create(height, width, CV_8UC1);
+        for (int y = 0; y < height; y++) {
+            uint8_t *src = p + y * bytesperline;
+            uint8_t *dst = y_copy.ptr(y);
+            for (int x = 0; x < width; x++)
+                dst[x] = src[x * 2];
+        }
+        frame = y_copy;
+    } else {
+        frame = Mat(height, width, CV_8UC1, p, bytesperline);
+    }
+    *pticks = buf_ticks(newest);
+    return true;
+}
+
+void v4l2_source::release()
+{
+    if (fd < 0)
+        return;
+    enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    xioctl(fd, VIDIOC_STREAMOFF, &type);
+    if (bufs) {
+        for (int n = 0; n < nbufs; n++)
+            if (bufs[n].start != MAP_FAILED)
+                munmap(bufs[n].start, bufs[n].length);
+        delete [] bufs;
+        bufs = NULL;
+    }
+    close(fd);
+    fd = -1;
+    held = -1;
+}
+
+uint32_t v4l2_source::dropped()
+{
+    return ndropped;
+}
+
+file_source::file_source()
+{
+    fd = -1;
+    base = NULL;
+    length = 0;
+    nframes = 0;
+    next = 0;
+    start = 0;
+    period = 0;
+    ndropped = 0;
+}
+
+bool file_source::open(const char *path, int width, int height, double fps)
+{
+    struct stat st;
+
+    fd = ::open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        printf("file_source: can't open %s\n", path);
+        return false;
+    }
+    this->width = width;
+    this->height = height;
+    length = st.st_size;
+    nframes = length / (width * height);
+    if (nframes == 0) {
+        printf("file_source: %s has no %dx%d frames\n", path, width, height);
+        return false;
+    }
+
+    // Private so drawing on a frame never touches the file
+    base = (uint8_t *)mmap(NULL, length, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE, fd, 0);
+    if (base == MAP_FAILED) {
+        printf("file_source: mmap failed\n");
+        base = NULL;
+        return false;
+    }
+    period = (uint64_t)(getTickFrequency() / fps);
+    printf("file_source: %s, %u frames\n", path, (uint32_t)nframes);
+    return true;
+}
+
+/*
+ * Frame n arrives at start + n * period, like a camera. If we are late
+ * the frames in between are dropped. The file repeats forever.
+ */
+bool file_source::grab(Mat &frame, uint64_t *pticks)
+{
+    uint64_t now = getTickCount();
+    if (start == 0)
+        start = now;
+
+    uint64_t n = (now - start) / period;
+    if (n < next) {
+        uint64_t due = start + next * period;
+        usleep((useconds_t)((due - now) * 1e6 / getTickFrequency()));
+        n = next;
+    } else {
+        ndropped += n - next;
+    }
+    next = n + 1;
+
+    frame = Mat(height, width, CV_8UC1,
+                base + (n % nframes) * width * height);
+    *pticks = start + n * period;
+    return true;
+}
+
+void file_source::release()
+{
+    if (base)
+        munmap(base, length);
+    if (fd >= 0)
+        close(fd);
+    base = NULL;
+    fd = -1;
+}
+
+uint32_t file_source::dropped()
+{
+    return ndropped;
+}
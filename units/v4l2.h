@@ -0,0 +1,79 @@
+/* 
+ * Copyright 2016 Robert Bond
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+/*
+ * Camera frames without VideoCapture. grab() hands out the newest
+ * frame, pointing straight into the source's buffer. It stays valid
+ * until the next grab().
+ */
+class raw_source {
+    public:
+        virtual ~raw_source() {}
+        virtual bool grab(Mat &frame, uint64_t *pticks) = 0;
+        virtual void release() = 0;
+        virtual uint32_t dropped() = 0;
+};
+
+struct v4l2_map {
+    void *start;
+    size_t length;
+};
+
+// V4L2 streaming with mmap'd driver buffers
+class v4l2_source : public raw_source {
+    public:
+        v4l2_source();
+        bool open(const char *dev, int width, int height, int nbufs);
+        bool grab(Mat &frame, uint64_t *pticks);
+        void release();
+        uint32_t dropped();
+    private:
+        int fd;
+        int nbufs;
+        struct v4l2_map *bufs;
+        int held;                   // Buffer the pipeline is using
+        uint32_t pixfmt;
+        int width;
+        int height;
+        int bytesperline;
+        uint32_t ndropped;
+        uint32_t last_sequence;
+        bool have_sequence;
+        Mat y_copy;                 // Only used for packed YUYV
+        bool fail(const char *msg);
+        void requeue(int index);
+};
+
+// Stand-in camera: a file of raw 8 bit frames played at fps
+class file_source : public raw_source {
+    public:
+        file_source();
+        bool open(const char *path, int width, int height, double fps);
+        bool grab(Mat &frame, uint64_t *pticks);
+        void release();
+        uint32_t dropped();
+    private:
+        int fd;
+        uint8_t *base;
+        size_t length;
+        int width;
+        int height;
+        uint64_t nframes;
+        uint64_t next;              // Next frame number due
+        uint64_t start;             // Ticks when frame 0 arrived
+        uint64_t period;            // Ticks per frame
+        uint32_t ndropped;
+};
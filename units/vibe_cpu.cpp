@@ -0,0 +1,501 @@
+/* 
+ * Copyright 2016 Robert Bond
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <iostream>
+#include <sys/time.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <math.h>
+#include <assert.h>
+#include <pthread.h>
+#include <string.h>
+
+#include <vector>
+
+#include "opencv2/core/core.hpp"
+
+using namespace std;
+using namespace cv;
+
+#include "vibe_cpu.h"
+#include "occupancy.h"
+
+/*
+ * ViBe, Barnich and Van Droogenbroeck, with the same parameters and
+ * output as the OpenCV gpu version. Each pixel keeps nbSamples old
+ * values. It is background when at least reqMatches of them are within
+ * radius. Background pixels copy themselves into a random sample of
+ * their own model and of a neighbor's model, each with probability
+ * 1/subsamplingFactor.
+ *
+ * Samples are stored as one plane per sample so 16 pixels are
+ * compared at a time. The frame is split into row bands, one per
+ * thread. Neighbor updates stay inside the band so threads never
+ * touch each other's samples. Bands start on occupancy tile rows so
+ * the tile counts aren't shared either.
+ */
+
+// gcc maps these onto SSE2 on x86 and NEON on arm
+typedef uint8_t v16u8 __attribute__ ((vector_size (16)));
+typedef uint32_t v4u32 __attribute__ ((vector_size (16)));
+
+struct vibe_band {
+    VIBE_CPU *pv;
+    int y0;                     // Rows y0 to y1 - 1
+    int y1;
+    uint32_t rng_own[4];        // xorshift32 per lane, own model updates
+    uint32_t rng_nbr[4];        // neighbor model updates
+    uint32_t rng;               // scalar xorshift32 for sample indexes
+};
+
+static inline uint32_t xorshift(uint32_t &s)
+{
+    s ^= s << 13;
+    s ^= s >> 17;
+    s ^= s << 5;
+    return s;
+}
+
+static inline v4u32 xorshift4(v4u32 &s)
+{
+    s ^= s << 13;
+    s ^= s >> 17;
+    s ^= s << 5;
+    return s;
+}
+
+static inline v16u8 load16(const uint8_t *p)
+{
+    v16u8 v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline void store16(uint8_t *p, v16u8 v)
+{
+    memcpy(p, &v, sizeof(v));
+}
+
+static inline v16u8 splat16(uint8_t b)
+{
+    v16u8 v;
+    memset(&v, b, sizeof(v));
+    return v;
+}
+
+static inline bool any16(v16u8 v)
+{
+    uint64_t w[2];
+    memcpy(w, &v, sizeof(w));
+    return (w[0] | w[1]) != 0;
+}
+
+static inline v16u8 absdiff16(v16u8 a, v16u8 b)
+{
+    v16u8 gt = (v16u8)(a > b);
+    return ((a - b) & gt) | ((b - a) & ~gt);
+}
+
+VIBE_CPU::VIBE_CPU(unsigned long rngSeed)
+{
+    nbSamples = 20;
+    reqMatches = 2;
+    radius = 20;
+    subsamplingFactor = 16;
+    nthreads = std::min(std::max(getNumberOfCPUs(), 1), 4);
+    rngSeed_ = rngSeed;
+    rng_ = (uint32_t)rngSeed | 1;
+    samples = NULL;
+    sstep = 0;
+    bands = NULL;
+    tids = NULL;
+    quit = false;
+    pframe = NULL;
+    pfg = NULL;
+    pocc = NULL;
+    active = NULL;
+}
+
+VIBE_CPU::~VIBE_CPU()
+{
+    release();
+}
+
+inline uint8_t *VIBE_CPU::sample_row(int k, int y)
+{
+    return samples + ((size_t)k * frameSize_.height + y) * sstep;
+}
+
+void VIBE_CPU::initialize(const Mat &firstFrame)
+{
+    assert(firstFrame.type() == CV_8UC1);
+    assert(nbSamples > 0 && nbSamples < 256);
+    assert((subsamplingFactor & (subsamplingFactor - 1)) == 0);
+
+    if (samples == NULL || firstFrame.size() != frameSize_)
+        allocate(firstFrame.size());
+
+    seed(firstFrame, Rect(0, 0, frameSize_.width, frameSize_.height));
+}
+
+void VIBE_CPU::allocate(Size size)
+{
+    release();
+    frameSize_ = size;
+    sstep = alignSize(frameSize_.width, 16);
+    samples = (uint8_t *)fastMalloc(nbSamples * frameSize_.height * sstep);
+    start_threads();
+}
+
+// Reseeds just the pixels in r, the rest of the model is kept
+void VIBE_CPU::initialize(const Mat &frame, Rect r)
+{
+    if (samples == NULL || frame.size() != frameSize_) {
+        initialize(frame);
+        return;
+    }
+    seed(frame, r & Rect(0, 0, frameSize_.width, frameSize_.height));
+}
+
+// Seeds every sample from the pixel's 3x3 neighborhood
+void VIBE_CPU::seed(const Mat &frame, Rect r)
+{
+    int rows = frameSize_.height;
+    int cols = frameSize_.width;
+    uint32_t rng = rng_;
+    for (int k = 0; k < nbSamples; k++) {
+        for (int y = r.y; y < r.y + r.height; y++) {
+            uint8_t *ps = sample_row(k, y);
+            for (int x = r.x; x < r.x + r.width; x++) {
+                uint32_t r = xorshift(rng);
+                int sx = x + (int)(r % 3) - 1;
+                int sy = y + (int)((r >> 8) % 3) - 1;
+                sx = std::min(std::max(sx, 0), cols - 1);
+                sy = std::min(std::max(sy, 0), rows - 1);
+                ps[x] = frame.at<uchar>(sy, sx);
+            }
+        }
+    }
+    rng_ = rng;
+}
+
+/*
+ * Adds the fg pixels found to *pocc's tile counts if pocc is set. If
+ * active is set only its OCC_TILE tiles are updated, laid out like
+ * pocc->bits, and the rest of fgmask is cleared.
+ */
+void VIBE_CPU::operator()(const Mat &frame, Mat &fgmask,
+                          struct fg_occupancy *pocc, const uint64_t *active)
+{
+    if (samples == NULL || frame.size() != frameSize_)
+        initialize(frame);
+
+    fgmask.create(frame.rows, frame.cols, CV_8UC1);
+    pframe = &frame;
+    pfg = &fgmask;
+    this->pocc = pocc;
+    this->active = active;
+
+    // Band 0 runs here, the rest on the workers
+    pthread_barrier_wait(&go);
+    update_band(&bands[0]);
+    pthread_barrier_wait(&done);
+}
+
+void VIBE_CPU::release()
+{
+    stop_threads();
+    if (samples)
+        fastFree(samples);
+    samples = NULL;
+    frameSize_ = Size();
+}
+
+// Bytes in a saved model, 0 if there is none
+size_t VIBE_CPU::model_size()
+{
+    if (samples == NULL)
+        return 0;
+    return sizeof(struct vibe_model_header) +
+           (size_t)nbSamples * frameSize_.height * sstep;
+}
+
+// The saved form of the model, model_size() bytes, into buf
+void VIBE_CPU::snapshot(uint8_t *buf)
+{
+    struct vibe_model_header hdr;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, VIBE_MODEL_MAGIC, sizeof(hdr.magic));
+    hdr.rows = frameSize_.height;
+    hdr.cols = frameSize_.width;
+    hdr.nbSamples = nbSamples;
+    hdr.sstep = sstep;
+    memcpy(buf, &hdr, sizeof(hdr));
+    memcpy(buf + sizeof(hdr), samples, model_size() - sizeof(hdr));
+}
+
+/*
+ * Writes a snapshot through a temp file, so a crash never leaves half a
+ * model behind. Touches nothing in the model, any thread can call it.
+ */
+bool VIBE_CPU::save_snapshot(const char *path, const uint8_t *buf,
+                             size_t len)
+{
+    char tmp_path[256];
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        printf("VIBE_CPU: can't create %s\n", tmp_path);
+        return false;
+    }
+    bool ok = write(fd, buf, len) == (ssize_t)len && fdatasync(fd) == 0;
+    close(fd);
+    if (!ok || rename(tmp_path, path) != 0) {
+        printf("VIBE_CPU: can't save %s\n", path);
+        unlink(tmp_path);
+        return false;
+    }
+    return true;
+}
+
+bool VIBE_CPU::save(const char *path)
+{
+    if (samples == NULL)
+        return false;
+    std::vector<uint8_t> buf(model_size());
+    snapshot(&buf[0]);
+    return save_snapshot(path, &buf[0], buf.size());
+}
+
+// The model has to be for the same frame size and nbSamples
+bool VIBE_CPU::load(const char *path)
+{
+    struct vibe_model_header hdr;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+    if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+        memcmp(hdr.magic, VIBE_MODEL_MAGIC, sizeof(hdr.magic)) != 0 ||
+        hdr.nbSamples != nbSamples || hdr.rows <= 0 || hdr.cols <= 0 ||
+        hdr.sstep != (int)alignSize(hdr.cols, 16)) {
+        printf("VIBE_CPU: %s isn't a usable model\n", path);
+        close(fd);
+        return false;
+    }
+
+    allocate(Size(hdr.cols, hdr.rows));
+    size_t len = (size_t)nbSamples * frameSize_.height * sstep;
+    bool ok = read(fd, samples, len) == (ssize_t)len;
+    close(fd);
+    if (!ok) {
+        printf("VIBE_CPU: %s is short\n", path);
+        release();
+    }
+    return ok;
+}
+
+// Fraction of the pixels the model would call fg, every 4th row and column
+double VIBE_CPU::mismatch(const Mat &frame)
+{
+    if (samples == NULL || frame.size() != frameSize_)
+        return 1.0;
+
+    int nfg = 0;
+    int n = 0;
+    for (int y = 0; y < frameSize_.height; y += 4) {
+        const uint8_t *pf = frame.ptr(y);
+        for (int x = 0; x < frameSize_.width; x += 4) {
+            int matches = 0;
+            for (int k = 0; k < nbSamples && matches < reqMatches; k++)
+                if (abs(pf[x] - sample_row(k, y)[x]) < radius)
+                    matches++;
+            if (matches < reqMatches)
+                nfg++;
+            n++;
+        }
+    }
+    return (double)nfg / n;
+}
+
+void VIBE_CPU::start_threads()
+{
+    int rows = frameSize_.height;
+    uint32_t seed = (uint32_t)rngSeed_ | 1;
+
+    bands = new vibe_band[nthreads];
+    for (int i = 0; i < nthreads; i++) {
+        struct vibe_band *pb = &bands[i];
+        pb->pv = this;
+        pb->y0 = (rows * i / nthreads) & ~(OCC_TILE - 1);
+        pb->y1 = (rows * (i + 1) / nthreads) & ~(OCC_TILE - 1);
+        if (i == nthreads - 1)
+            pb->y1 = rows;
+        for (int j = 0; j < 4; j++) {
+            pb->rng_own[j] = xorshift(seed) | 1;
+            pb->rng_nbr[j] = xorshift(seed) | 1;
+        }
+        pb->rng = xorshift(seed) | 1;
+    }
+
+    quit = false;
+    pthread_barrier_init(&go, NULL, nthreads);
+    pthread_barrier_init(&done, NULL, nthreads);
+    tids = new pthread_t[nthreads];
+    for (int i = 1; i < nthreads; i++)
+        pthread_create(&tids[i], NULL, worker, &bands[i]);
+}
+
+void VIBE_CPU::stop_threads()
+{
+    if (!bands)
+        return;
+    quit = true;
+    pthread_barrier_wait(&go);
+    for (int i = 1; i < nthreads; i++)
+        pthread_join(tids[i], NULL);
+    pthread_barrier_destroy(&go);
+    pthread_barrier_destroy(&done);
+    delete [] tids;
+    delete [] bands;
+    tids = NULL;
+    bands = NULL;
+}
+
+void *VIBE_CPU::worker(void *arg)
+{
+    struct vibe_band *pb = (struct vibe_band *)arg;
+    VIBE_CPU *pv = pb->pv;
+
+    for (;;) {
+        pthread_barrier_wait(&pv->go);
+        if (pv->quit)
+            break;
+        pv->update_band(pb);
+        pthread_barrier_wait(&pv->done);
+    }
+    return NULL;
+}
+
+// Copies v into a random sample of x, y and/or of one of its neighbors
+inline void VIBE_CPU::update_pixel(struct vibe_band *pb, int x, int y,
+                                   uint8_t v, bool own, bool nbr)
+{
+    if (own)
+        sample_row(xorshift(pb->rng) % nbSamples, y)[x] = v;
+    if (nbr) {
+        uint32_t r = xorshift(pb->rng);
+        int nx = x + (int)(r % 3) - 1;
+        int ny = y + (int)((r >> 8) % 3) - 1;
+        nx = std::min(std::max(nx, 0), frameSize_.width - 1);
+        ny = std::min(std::max(ny, pb->y0), pb->y1 - 1);
+        sample_row((r >> 16) % nbSamples, ny)[nx] = v;
+    }
+}
+
+void VIBE_CPU::update_band(struct vibe_band *pb)
+{
+    int cols = frameSize_.width;
+    int vcols = cols & ~15;
+    size_t plane = (size_t)frameSize_.height * sstep;
+    uint32_t phi = subsamplingFactor - 1;
+    v16u8 rad = splat16(radius);
+    v16u8 req = splat16(reqMatches);
+    v16u8 phimask = splat16(phi);
+    v16u8 zero = splat16(0);
+    v4u32 rng_own;
+    v4u32 rng_nbr;
+
+    memcpy(&rng_own, pb->rng_own, sizeof(rng_own));
+    memcpy(&rng_nbr, pb->rng_nbr, sizeof(rng_nbr));
+
+    for (int y = pb->y0; y < pb->y1; y++) {
+        const uint8_t *pf = pframe->ptr(y);
+        uint8_t *pm = pfg->ptr(y);
+        const uint8_t *ps = sample_row(0, y);
+        uint16_t *pcount = NULL;
+        uint64_t on = active ? active[y / OCC_TILE] : ~0ULL;
+        int x;
+
+        if (pocc)
+            pcount = &occ_tile(pocc, 0, y / OCC_TILE);
+
+        for (x = 0; x < vcols; x += 16) {
+            if (!((on >> (x / OCC_TILE)) & 1)) {
+                store16(pm + x, zero);
+                continue;
+            }
+            v16u8 f = load16(pf + x);
+            v16u8 count = zero;
+            for (int k = 0; k < nbSamples; k++) {
+                v16u8 d = absdiff16(f, load16(ps + k * plane + x));
+                count -= (v16u8)(d < rad);
+            }
+            v16u8 fg = (v16u8)(count < req);
+            store16(pm + x, fg);
+            if (pcount && any16(fg)) {
+                uint64_t w[2];
+                memcpy(w, &fg, sizeof(w));
+                pcount[x / OCC_TILE] += (__builtin_popcountll(w[0]) +
+                                         __builtin_popcountll(w[1])) / 8;
+            }
+
+            v16u8 own = (v16u8)((v16u8)xorshift4(rng_own) & phimask) == zero;
+            v16u8 nbr = (v16u8)((v16u8)xorshift4(rng_nbr) & phimask) == zero;
+            own &= ~fg;
+            nbr &= ~fg;
+            if (!any16(own | nbr))
+                continue;
+
+            uint8_t mown[16];
+            uint8_t mnbr[16];
+            store16(mown, own);
+            store16(mnbr, nbr);
+            for (int i = 0; i < 16; i++)
+                if (mown[i] | mnbr[i])
+                    update_pixel(pb, x + i, y, pf[x + i], mown[i], mnbr[i]);
+        }
+
+        // Leftover columns one at a time
+        for (; x < cols; x++) {
+            if (!((on >> (x / OCC_TILE)) & 1)) {
+                pm[x] = 0;
+                continue;
+            }
+            int count = 0;
+            for (int k = 0; k < nbSamples; k++)
+                if (abs((int)pf[x] - (int)ps[k * plane + x]) < radius)
+                    count++;
+            pm[x] = count < reqMatches ? 255 : 0;
+            if (pm[x] && pcount)
+                pcount[x / OCC_TILE]++;
+            if (pm[x] == 0) {
+                bool own = (xorshift(pb->rng) & phi) == 0;
+                bool nbr = (xorshift(pb->rng) & phi) == 0;
+                update_pixel(pb, x, y, pf[x], own, nbr);
+            }
+        }
+    }
+
+    memcpy(pb->rng_own, &rng_own, sizeof(rng_own));
+    memcpy(pb->rng_nbr, &rng_nbr, sizeof(rng_nbr));
+}
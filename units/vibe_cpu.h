@@ -0,0 +1,82 @@
+/* 
+ * Copyright 2016 Robert Bond
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#include <pthread.h>
+
+struct vibe_band;
+struct fg_occupancy;
+
+#define VIBE_MODEL_MAGIC "VIBEMDL1"
+
+// In front of the sample planes in a saved model
+struct vibe_model_header {
+    char magic[8];
+    int32_t rows;
+    int32_t cols;
+    int32_t nbSamples;
+    int32_t sstep;
+};
+
+// Host version of gpu::VIBE_GPU. Same calls, same 0/255 fg mask.
+class VIBE_CPU {
+    public:
+        explicit VIBE_CPU(unsigned long rngSeed = 1234567);
+        ~VIBE_CPU();
+        void initialize(const Mat &firstFrame);
+        void initialize(const Mat &frame, Rect r);
+        void operator()(const Mat &frame, Mat &fgmask,
+                        struct fg_occupancy *pocc = NULL,
+                        const uint64_t *active = NULL);
+        void release();
+        bool save(const char *path);
+        size_t model_size();
+        void snapshot(uint8_t *buf);
+        static bool save_snapshot(const char *path, const uint8_t *buf,
+                                  size_t len);
+        bool load(const char *path);
+        double mismatch(const Mat &frame);
+
+        int nbSamples;              // number of samples per pixel
+        int reqMatches;             // #_min
+        int radius;                 // R
+        int subsamplingFactor;      // amount of random subsampling, power of 2
+        int nthreads;               // row bands run in parallel
+    private:
+        Size frameSize_;
+        unsigned long rngSeed_;
+        uint32_t rng_;              // For seeding
+        uint8_t *samples;           // nbSamples planes of rows * sstep
+        size_t sstep;
+        struct vibe_band *bands;
+        pthread_t *tids;
+        pthread_barrier_t go;
+        pthread_barrier_t done;
+        bool quit;
+        const Mat *pframe;
+        Mat *pfg;
+        struct fg_occupancy *pocc;
+        const uint64_t *active;
+
+        uint8_t *sample_row(int k, int y);
+        void allocate(Size size);
+        void seed(const Mat &frame, Rect r);
+        void start_threads();
+        void stop_threads();
+        static void *worker(void *arg);
+        void update_pixel(struct vibe_band *pb, int x, int y,
+                          uint8_t v, bool own, bool nbr);
+        void update_band(struct vibe_band *pb);
+};